@@ -0,0 +1,79 @@
+#!/usr/bin/env python3
+# Benchmarks cpi2hex on synthetic FONT, FONT.NT and DR-DOS files made by mkcpi.py, reporting
+# MB/s of input and glyphs/s for each phase. Run from the top directory with make bench, or
+# python3 bench/bench.py [-c codepages] [-r runs] [-a "extra cpi2hex options"]
+
+import argparse
+import os
+import shlex
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+BENCH = os.path.dirname(os.path.abspath(__file__))
+TOP = os.path.dirname(BENCH)
+CPI2HEX = os.path.join(TOP, "cpi2hex")
+PARSE = os.path.join(BENCH, "parse")
+
+TYPES = [("font", "FONT"), ("nt", "FONT.NT"), ("drdos", "DRFONT")]
+
+
+def best_time(runs, command, cwd, clean):
+	best = None
+	for _ in range(runs):
+		clean()
+		start = time.perf_counter()
+		subprocess.run(command, cwd=cwd, stdout=subprocess.DEVNULL, check=True)
+		elapsed = time.perf_counter() - start
+		best = elapsed if best is None else min(best, elapsed)
+	return best
+
+
+def empty_dir(path):
+	def clean():
+		shutil.rmtree(path, ignore_errors=True)
+		os.mkdir(path)
+	return clean
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Benchmark cpi2hex")
+	parser.add_argument("-c", "--codepages", type=int, default=512, help="code pages per file, each with 8x6, 8x8, 8x14 and 8x16 fonts")
+	parser.add_argument("-r", "--runs", type=int, default=3, help="runs per phase, the best is reported")
+	parser.add_argument("-a", "--args", default="", help="extra options passed to cpi2hex")
+	args = parser.parse_args()
+	extra = shlex.split(args.args)
+
+	work = tempfile.mkdtemp(prefix="cpi2hex-bench-")
+	try:
+		print("%-8s %-8s %10s %14s %10s" % ("file", "phase", "MB/s", "glyphs/s", "seconds"))
+		for kind, name in TYPES:
+			cpi = os.path.join(work, kind + ".cpi")
+			subprocess.run([sys.executable, os.path.join(BENCH, "mkcpi.py"), "-t", kind, "-c", str(args.codepages), cpi], check=True)
+			mb = os.path.getsize(cpi) / 1e6
+
+			iterations = 10
+			out = subprocess.run([PARSE, cpi, str(iterations)], check=True, stdout=subprocess.PIPE, text=True).stdout.split()
+			glyphs = int(out[1]) // iterations
+			seconds = float(out[2]) / iterations
+			results = [("parse", seconds)]
+
+			out_dir = os.path.join(work, "out")
+			phases = [
+				("info", [CPI2HEX, cpi, "-i"]),
+				("header", [CPI2HEX, cpi, "-o", "font.h"]),
+				("binary", [CPI2HEX, cpi, "-b"]),
+			]
+			for phase, command in phases:
+				results.append((phase, best_time(args.runs, command + extra, out_dir, empty_dir(out_dir))))
+
+			for phase, seconds in results:
+				print("%-8s %-8s %10.1f %14.0f %10.4f" % (name, phase, mb / seconds, glyphs / seconds, seconds))
+	finally:
+		shutil.rmtree(work, ignore_errors=True)
+
+
+if __name__ == "__main__":
+	main()
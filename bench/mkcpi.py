@@ -0,0 +1,125 @@
+#!/usr/bin/env python3
+# Generates synthetic CPI files of any size for benchmarking cpi2hex.
+# python3 mkcpi.py [-t font|nt|drdos] [-c codepages | -m megabytes] [-s 6,8,14,16] [-w 8] out.cpi
+
+import argparse
+import random
+import struct
+
+FONT_FILE_HEADER_SIZE = 23
+CODE_PAGE_ENTRY_HEADER_SIZE = 28
+CODE_PAGE_INFO_HEADER_SIZE = 6
+SCREEN_FONT_HEADER_SIZE = 6
+CHARACTER_INDEX_TABLE_SIZE = 256 * 2
+
+FIRST_CODE_PAGE = 1000
+POOL_GLYPHS = 1024  # Distinct glyphs per size, so -s and --compress find some repeats
+
+
+def glyph_pool(rng, width, height):
+	# Glyphs with blank rows above and below, like real fonts
+	stride = (width + 7) // 8
+	margin = max(1, height // 8)
+	pool = []
+	for _ in range(POOL_GLYPHS):
+		rows = bytes(margin * stride)
+		rows += rng.getrandbits(8 * stride * (height - 2 * margin)).to_bytes(stride * (height - 2 * margin), "little")
+		rows += bytes(margin * stride)
+		pool.append(rows)
+	return pool
+
+
+def file_header(id0, name, fih_offset):
+	return struct.pack("<B7s8sHBI", id0, name, bytes(8), 1, 1, fih_offset)
+
+
+def entry_header(offset, next_offset, cpih_offset, codepage):
+	return struct.pack("<HIH8sH6sI", CODE_PAGE_ENTRY_HEADER_SIZE, next_offset, 1, b"EGA     ", codepage, bytes(6), cpih_offset)
+
+
+def font_file(args, pools):
+	# FONT and FONT.NT: each code page holds its own copy of every font. FONT.NT offsets are
+	# relative to the entry header.
+	nt = args.type == "nt"
+	stride = (args.width + 7) // 8
+	fonts_size = sum(SCREEN_FONT_HEADER_SIZE + 256 * stride * h for h in args.sizes)
+	entry_size = CODE_PAGE_ENTRY_HEADER_SIZE + CODE_PAGE_INFO_HEADER_SIZE + fonts_size
+
+	out = [file_header(0xFF, b"FONT.NT" if nt else b"FONT   ", FONT_FILE_HEADER_SIZE), struct.pack("<H", args.codepages)]
+	offset = FONT_FILE_HEADER_SIZE + 2
+	for i in range(args.codepages):
+		last = i == args.codepages - 1
+		next_offset = 0 if last else (entry_size if nt else offset + entry_size)
+		cpih_offset = CODE_PAGE_ENTRY_HEADER_SIZE if nt else offset + CODE_PAGE_ENTRY_HEADER_SIZE
+		out.append(entry_header(offset, next_offset, cpih_offset, FIRST_CODE_PAGE + i))
+		out.append(struct.pack("<HHH", 1, len(args.sizes), fonts_size))
+		for h in args.sizes:
+			out.append(struct.pack("<BBBBH", h, args.width, 0, 0, 256))
+			pool = pools[h]
+			out.append(b"".join(pool[(c * 7 + i * 13) % POOL_GLYPHS] for c in range(256)))
+		offset += entry_size
+	return b"".join(out)
+
+
+def drdos_file(args, pools, rng):
+	# DR-DOS: code pages only hold a CharacterIndexTable into one glyph pool per size, which
+	# follows the last code page
+	n = len(args.sizes)
+	fih_offset = FONT_FILE_HEADER_SIZE + 1 + 5 * n
+	entry_size = CODE_PAGE_ENTRY_HEADER_SIZE + CODE_PAGE_INFO_HEADER_SIZE + SCREEN_FONT_HEADER_SIZE * n + CHARACTER_INDEX_TABLE_SIZE
+	pool_offset = fih_offset + 2 + entry_size * args.codepages
+	stride = (args.width + 7) // 8
+
+	pool_offsets = []
+	for h in args.sizes:
+		pool_offsets.append(pool_offset)
+		pool_offset += POOL_GLYPHS * stride * h
+
+	out = [file_header(0x7F, b"DRFONT ", fih_offset), struct.pack("<B", n), bytes(args.sizes)]
+	out.append(struct.pack("<%iI" % n, *pool_offsets))
+	out.append(struct.pack("<H", args.codepages))
+	offset = fih_offset + 2
+	for i in range(args.codepages):
+		next_offset = 0 if i == args.codepages - 1 else offset + entry_size
+		out.append(entry_header(offset, next_offset, offset + CODE_PAGE_ENTRY_HEADER_SIZE, FIRST_CODE_PAGE + i))
+		out.append(struct.pack("<HHH", 2, n, SCREEN_FONT_HEADER_SIZE * n + CHARACTER_INDEX_TABLE_SIZE))
+		for h in args.sizes:
+			out.append(struct.pack("<BBBBH", h, args.width, 0, 0, 256))
+		out.append(struct.pack("<256H", *(rng.randrange(POOL_GLYPHS) for _ in range(256))))
+		offset += entry_size
+	for h in args.sizes:
+		out.append(b"".join(pools[h]))
+	return b"".join(out)
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Generate a synthetic CPI file")
+	parser.add_argument("-t", "--type", choices=["font", "nt", "drdos"], default="font")
+	parser.add_argument("-c", "--codepages", type=int, default=64)
+	parser.add_argument("-m", "--megabytes", type=float, help="size of the file, overrides -c")
+	parser.add_argument("-s", "--sizes", default="6,8,14,16", help="font heights")
+	parser.add_argument("-w", "--width", type=int, default=8)
+	parser.add_argument("--seed", type=int, default=1)
+	parser.add_argument("out")
+	args = parser.parse_args()
+
+	args.sizes = [int(h) for h in args.sizes.split(",")]
+	if args.megabytes:
+		stride = (args.width + 7) // 8
+		if args.type == "drdos":
+			per_codepage = CODE_PAGE_ENTRY_HEADER_SIZE + CODE_PAGE_INFO_HEADER_SIZE + SCREEN_FONT_HEADER_SIZE * len(args.sizes) + CHARACTER_INDEX_TABLE_SIZE
+		else:
+			per_codepage = CODE_PAGE_ENTRY_HEADER_SIZE + CODE_PAGE_INFO_HEADER_SIZE + sum(SCREEN_FONT_HEADER_SIZE + 256 * stride * h for h in args.sizes)
+		args.codepages = max(1, int(args.megabytes * 1000000 / per_codepage))
+	if not 1 <= args.codepages <= 65535 - FIRST_CODE_PAGE:
+		parser.error("between 1 and %i code pages can be generated" % (65535 - FIRST_CODE_PAGE))
+
+	rng = random.Random(args.seed)
+	pools = {h: glyph_pool(rng, args.width, h) for h in args.sizes}
+	data = drdos_file(args, pools, rng) if args.type == "drdos" else font_file(args, pools)
+	with open(args.out, "wb") as f:
+		f.write(data)
+
+
+if __name__ == "__main__":
+	main()
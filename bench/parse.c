@@ -0,0 +1,81 @@
+/********************************************************************************************
+* cpi2hex benchmark
+* Walks every code page and font of a CPI file through libcpi and reads every glyph,
+* a number of times, and prints the bytes and glyphs parsed and the time taken.
+*
+* cpi2hex is free and open source software provided under the terms of The MIT License (MIT)
+* See accompanying license file for details.
+*
+* Copyright (C) 2017 by Peter McKeon 15/10/2017
+*********************************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/libcpi.h"
+
+double now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2)
+	{
+		printf("parse <file> [iterations]\n");
+		exit(0);
+	}
+	int iterations = argc > 2 ? atoi(argv[2]) : 10;
+
+	int fd = open(argv[1], O_RDONLY);
+	struct cpi_file cpi;
+	int err = fd < 0 ? CPI_ERROR_IO : cpi_open_fd(&cpi, fd);
+	if (fd >= 0)
+		close(fd);
+	if (err != CPI_OK)
+	{
+		printf("Error: %s: %s\n", argv[1], cpi_strerror(err));
+		exit(1);
+	}
+
+	long long glyphs = 0;
+	unsigned sum = 0;
+	double start = now();
+	for (int i = 0; i < iterations; ++i)
+	{
+		struct cpi_codepage cp;
+		for (err = cpi_first_codepage(&cpi, &cp); err == CPI_OK; err = cpi_next_codepage(&cpi, &cp))
+		{
+			for (int n = 0; n < cp.num_fonts; ++n)
+			{
+				struct cpi_font font;
+				if (cpi_font(&cpi, &cp, n, 1, &font) != CPI_OK)
+					continue;
+				for (int c = 0; c < font.num_chars; ++c)
+				{
+					const unsigned char *glyph = cpi_glyph(&font, c);
+					for (int b = 0; b < font.stride; ++b)
+						sum += glyph[b];
+				}
+				glyphs += font.num_chars;
+			}
+		}
+		if (err != CPI_END)
+		{
+			printf("Error: %s: %s\n", argv[1], cpi_strerror(err));
+			exit(1);
+		}
+	}
+	double seconds = now() - start;
+
+	// The checksum keeps the glyph reads from being optimised away
+	printf("%lld %lld %.6f %u\n", (long long)cpi.size * iterations, glyphs, seconds, sum);
+	cpi_close(&cpi);
+	return 0;
+}
@@ -12,104 +12,3001 @@
 * Copyright (C) 2017 by Peter McKeon 15/10/2017
 *********************************************************************************************/
 
+#ifdef __linux__
+#define _GNU_SOURCE // copy_file_range
+#endif
+
+#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <direct.h>
+#include <process.h>
+#else
+#include <dirent.h>
+#include <pthread.h>
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+
+#include "libcpi.h"
+
+// Part of the --cache key, so that cached output is rebuilt by a new version
+#define CPI2HEX_VERSION "1.1.0"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+enum
+{
+	OUTPUT_HEADER,
+	OUTPUT_BINARY,
+	OUTPUT_ELF,
+	OUTPUT_ASM,
+	OUTPUT_EMBED,
+	OUTPUT_SHARED,
+	OUTPUT_UNICODE
+};
+
+enum
+{
+	LAYOUT_ROWS,
+	LAYOUT_COLUMNS,
+	LAYOUT_PAGES
+};
+
+#define FLIP_H 1
+#define FLIP_V 2
+
+enum
+{
+	COMPRESS_NONE,
+	COMPRESS_RLE,
+	COMPRESS_DICT
+};
+
+enum
+{
+	FORMAT_TEXT,
+	FORMAT_JSON,
+	FORMAT_CSV
+};
+
+#define EM_ARM 40
+#define EM_X86_64 62
+
+struct
+{
+	unsigned int info : 1;
+	unsigned int debug : 1;
+	unsigned int sidecar : 1;
+	unsigned int stream : 1; // Output to stdout with -o -
+	unsigned int lsb_first : 1; // Leftmost pixel in bit 0 with --bits=lsb
+	unsigned int big_endian : 1;
+	int output;
+	int format;
+	int layout;
+	int word;           // Bytes per word that rows are packed into with --word, 0 for bytes
+	int bpp;            // Bits per output pixel
+	int fg;             // Pixel values for set and clear bits, -1 for the default
+	int bg;
+	int pack;           // Rows are repacked by pack_glyph
+	int compress;
+	const char *cache;  // --cache directory
+	int stats;          // STATS_TEXT or STATS_JSON with --stats
+	int rotate;         // Degrees clockwise
+	int flip;           // FLIP_H and/or FLIP_V, applied after rotating
+	int transpose;      // --rotate and --flip reduced to an optional transpose...
+	int orient;         // ...followed by these flips
+	int elf_machine;
+	short codepage;
+	int jobs;
+} options;
+
+#define MAX_CHARS 65536
+
+// Characters picked with -r, normalised into sorted runs of consecutive characters
+struct
+{
+	unsigned char bits[MAX_CHARS / 8];
+	int used;           // Any -r given, otherwise every character of each font is extracted
+	int open_from;      // Start of the first range running to the end of the font
+	int (*run)[2];
+	int num_runs;
+} Selection;
+
+#define PATH_SIZE 1024
+
+// Format a path into a PATH_SIZE buffer, rejecting any that doesn't fit rather than cutting it short
+void path_printf(char *dest, const char *format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int len = vsnprintf(dest, PATH_SIZE, format, args);
+	va_end(args);
+	if (len < 0 || len >= PATH_SIZE)
+	{
+		printf("Error: Path too long: %s...\n", dest);
+		exit(1);
+	}
+}
+
+#define STATS_TEXT 1
+#define STATS_JSON 2
+
+// Work counted for --stats. Each font keeps its own counters while it is extracted, so worker
+// threads never share them, and everything else is counted against the input file.
+struct Counters
+{
+	double parse;           // Seconds reading headers and checking fonts
+	double format;          // Seconds building output data
+	double write;           // Seconds comparing and writing output files
+	long long headers;      // Code page and font headers parsed
+	long long bytes_read;
+	long long bytes_written;
+	long long seeks;        // Copies from the input that don't start where the font's last one ended
+	long long syscalls;     // Calls made reading the input and reading and writing files
+	long long glyphs;       // Glyphs output
+};
+
+#ifdef _MSC_VER
+#define THREAD_LOCAL __declspec(thread)
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+struct Counters FileStats;
+struct Counters RunStats;
+THREAD_LOCAL struct Counters *Counting = &FileStats; // Where the thread's file I/O is counted
+THREAD_LOCAL long InputNext; // End of the last copy from the input for the font being extracted
+
+struct cpi_file CpiFile;
+int InputFd = -1; // Kept open so that binary output can be copied straight from the file
+
+// Map the whole input file into memory, or read it in one go where mmap is unavailable.
+// An input of - is read from stdin.
+void open_input(const char *name)
+{
+	int fd = strcmp(name, "-") == 0 ? 0 : open(name, O_RDONLY | O_BINARY);
+	if (fd < 0)
+	{
+		printf("Error: Could not open file %s\n", name);
+		exit(1);
+	}
+
+	int err = cpi_open_fd(&CpiFile, fd);
+	InputFd = fd;
+	FileStats.syscalls += (fd != 0) + CpiFile.syscalls;
+	if (err == CPI_ERROR_IO)
+	{
+		printf("Error: Could not open file %s\n", name);
+		exit(1);
+	}
+	if (err != CPI_OK)
+	{
+		printf("Error: %s\n", cpi_strerror(err));
+		exit(1);
+	}
+}
+
+#define OUTPUT_BUFFER_SIZE (256 * 1024)
+
+// Output is built in memory and only written once complete, see commit_output
+struct OutputBuffer
+{
+	char *buf;
+	size_t len;
+	size_t cap;
+};
+
+void close_input(void)
+{
+	FileStats.syscalls += (CpiFile.mapped == CPI_MAPPED) + (InputFd > 0); // munmap and close
+	cpi_close(&CpiFile);
+	if (InputFd > 0)
+		close(InputFd);
+	InputFd = -1;
+}
+
+// Output of -o -. stdout itself is pointed at stderr so that messages stay out of the data.
+int DataFd = -1;
+
+// "0xHH," for every byte value, so formatting never goes through printf
+char HexTable[256][5];
+
+void init_hex_table(void)
+{
+	const char digits[] = "0123456789ABCDEF";
+
+	for (int i = 0; i < 256; ++i)
+	{
+		HexTable[i][0] = '0';
+		HexTable[i][1] = 'x';
+		HexTable[i][2] = digits[i >> 4];
+		HexTable[i][3] = digits[i & 0xF];
+		HexTable[i][4] = ',';
+	}
+}
+
+// Make room for n more bytes
+void out_reserve(struct OutputBuffer *ob, size_t n)
+{
+	if (ob->len + n <= ob->cap)
+		return;
+
+	size_t cap = ob->cap ? ob->cap : OUTPUT_BUFFER_SIZE;
+	while (cap < ob->len + n)
+		cap *= 2;
+	char *buf = (char *)realloc(ob->buf, cap);
+	if (buf == NULL)
+	{
+		printf("Error: Out of memory\n");
+		exit(1);
+	}
+	ob->buf = buf;
+	ob->cap = cap;
+}
+
+void out_write(struct OutputBuffer *ob, const void *p, size_t n)
+{
+	out_reserve(ob, n);
+	memcpy(ob->buf + ob->len, p, n);
+	ob->len += n;
+}
+
+void out_str(struct OutputBuffer *ob, const char *str)
+{
+	out_write(ob, str, strlen(str));
+}
+
+void out_le(struct OutputBuffer *ob, unsigned long long value, int bytes)
+{
+	unsigned char le[8];
+	for (int i = 0; i < bytes; ++i)
+		le[i] = (unsigned char)(value >> (i * 8));
+	out_write(ob, le, bytes);
+}
+
+void out_zero(struct OutputBuffer *ob, size_t n)
+{
+	out_reserve(ob, n);
+	memset(ob->buf + ob->len, 0, n);
+	ob->len += n;
+}
+
+#ifdef _WIN32
+CRITICAL_SECTION JobLock;
+#else
+pthread_mutex_t JobLock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+void job_lock(void)
+{
+#ifdef _WIN32
+	EnterCriticalSection(&JobLock);
+#else
+	pthread_mutex_lock(&JobLock);
+#endif
+}
+
+void job_unlock(void)
+{
+#ifdef _WIN32
+	LeaveCriticalSection(&JobLock);
+#else
+	pthread_mutex_unlock(&JobLock);
+#endif
+}
+
+// Seconds from an arbitrary start, only read with --stats
+double stats_clock(void)
+{
+	if (!options.stats)
+		return 0;
+#ifdef _WIN32
+	LARGE_INTEGER count, frequency;
+	QueryPerformanceCounter(&count);
+	QueryPerformanceFrequency(&frequency);
+	return (double)count.QuadPart / frequency.QuadPart;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+#endif
+}
+
+void add_counters(struct Counters *to, const struct Counters *from)
+{
+	to->parse += from->parse;
+	to->format += from->format;
+	to->write += from->write;
+	to->headers += from->headers;
+	to->bytes_read += from->bytes_read;
+	to->bytes_written += from->bytes_written;
+	to->seeks += from->seeks;
+	to->syscalls += from->syscalls;
+	to->glyphs += from->glyphs;
+}
+
+// Output files written for the current input, recorded for --cache as a name length, name,
+// data length and data per file
+struct
+{
+	int recording;
+	struct OutputBuffer files;
+} Cache;
+
+#define CACHE_MAGIC "CPI2HEXC"
+
+// Make rules for -MD, one per input naming every output it wrote as a target of the input
+struct
+{
+	int enabled;
+	const char *file;      // -MF name, or NULL to name each depfile after its -o file
+	struct OutputBuffer targets;
+	struct OutputBuffer rules;
+} Deps;
+
+void cache_add(const char *name, const void *data, size_t len)
+{
+	if (!Cache.recording)
+		return;
+
+	job_lock();
+	out_le(&Cache.files, strlen(name), 4);
+	out_str(&Cache.files, name);
+	out_le(&Cache.files, len, 8);
+	out_write(&Cache.files, data, len);
+	job_unlock();
+}
+
+// Add a path to a depfile, escaping the characters make treats specially
+void dep_path(struct OutputBuffer *ob, const char *path)
+{
+	for (const char *p = path; *p; ++p)
+	{
+		if (*p == ' ' || *p == '#')
+			out_write(ob, "\\", 1);
+		else if (*p == '$')
+			out_write(ob, "$", 1);
+		out_write(ob, p, 1);
+	}
+}
+
+void dep_add(const char *name)
+{
+	if (!Deps.enabled || strcmp(name, "-") == 0)
+		return;
+
+	job_lock();
+	if (Deps.targets.len)
+		out_str(&Deps.targets, " \\\n ");
+	dep_path(&Deps.targets, name);
+	job_unlock();
+}
+
+// Read len bytes from fd, returning 0 if the file ends first or can't be read
+int read_all(int fd, void *data, size_t len)
+{
+	char *p = (char *)data;
+	while (len > 0)
+	{
+		long n = (long)read(fd, p, (unsigned int)(len < (1 << 30) ? len : (1 << 30)));
+		Counting->syscalls++;
+		if (n <= 0)
+			return 0;
+		Counting->bytes_read += n;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+// Write len bytes to fd, returning 0 if they can't all be written
+int write_all(int fd, const void *data, size_t len)
+{
+	const char *p = (const char *)data;
+	while (len > 0)
+	{
+		long n = (long)write(fd, p, (unsigned int)(len < (1 << 30) ? len : (1 << 30)));
+		Counting->syscalls++;
+		if (n <= 0)
+			return 0;
+		Counting->bytes_written += n;
+		p += n;
+		len -= n;
+	}
+	return 1;
+}
+
+long long file_size(const char *name)
+{
+	struct stat st;
+	Counting->syscalls++;
+	return stat(name, &st) == 0 ? (long long)st.st_size : -1;
+}
+
+// Contents of file name if it is exactly len bytes long, otherwise NULL
+unsigned char *read_existing(const char *name, size_t len)
+{
+	if (file_size(name) != (long long)len)
+		return NULL;
+
+	int fd = open(name, O_RDONLY | O_BINARY);
+	Counting->syscalls++;
+	if (fd < 0)
+		return NULL;
+	unsigned char *data = (unsigned char *)malloc(len ? len : 1);
+	if (data == NULL || !read_all(fd, data, len))
+	{
+		free(data);
+		data = NULL;
+	}
+	close(fd);
+	Counting->syscalls++;
+	return data;
+}
+
+void temp_name(char *tmp, const char *name)
+{
+	snprintf(tmp, PATH_SIZE + 32, "%s.%i.tmp", name, (int)getpid());
+}
+
+// Move a finished temporary file over name, so that readers never see a partial file. Returns
+// 0 if it can't be moved, removing the temporary file.
+int replace_file(const char *tmp, const char *name)
+{
+#ifdef _WIN32
+	int ok = MoveFileExA(tmp, name, MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+	int ok = rename(tmp, name) == 0;
+#endif
+	Counting->syscalls++;
+	if (!ok)
+		remove(tmp);
+	return ok;
+}
+
+// Write name through a temporary file, returning 0 if that fails, with any existing file left
+// as it was. A file that already holds the same bytes is left alone, so its mtime only changes
+// with its content and unchanged fonts don't trigger rebuilds.
+int update_file(const char *name, const void *data, size_t len)
+{
+	unsigned char *existing = read_existing(name, len);
+	int same = existing != NULL && memcmp(existing, data, len) == 0;
+	free(existing);
+	if (same)
+		return 1;
+
+	char tmp[PATH_SIZE + 32];
+	temp_name(tmp, name);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+	Counting->syscalls++;
+	if (fd < 0)
+		return 0;
+	int ok = write_all(fd, data, len);
+	ok = close(fd) == 0 && ok;
+	Counting->syscalls++;
+	if (!ok)
+	{
+		remove(tmp);
+		return 0;
+	}
+	return replace_file(tmp, name);
+}
+
+void write_file(const char *name, const void *data, size_t len)
+{
+	if (!update_file(name, data, len))
+	{
+		printf("Error: Could not write output file %s\n", name);
+		exit(1);
+	}
+}
+
+// Write a finished file, or to stdout for -
+void write_output(const char *name, const void *data, size_t len)
+{
+	double start = stats_clock();
+	if (strcmp(name, "-") == 0)
+	{
+		if (!write_all(DataFd, data, len))
+		{
+			printf("Error: Could not write to stdout\n");
+			exit(1);
+		}
+	}
+	else
+		write_file(name, data, len);
+	Counting->write += stats_clock() - start;
+}
+
+// Write an output of the current input, recording it for --cache and -MD
+void commit_output(const char *name, const void *data, size_t len)
+{
+	cache_add(name, data, len);
+	dep_add(name);
+	write_output(name, data, len);
+}
+
+// Write one glyph as a row of "0xHH," (or "0xHHHH," words of 2 or 4 bytes) followed by a newline,
+// closing the array after the last one
+void out_glyph(struct OutputBuffer *ob, const unsigned char *data, int size, int word, int last)
+{
+	out_reserve(ob, (size_t)size * 5 + 4);
+
+	char *p = ob->buf + ob->len;
+	if (word > 1)
+	{
+		for (int i = 0; i < size; i += word)
+		{
+			*p++ = '0';
+			*p++ = 'x';
+			for (int j = 0; j < word; ++j)
+			{
+				memcpy(p, HexTable[data[i + (options.big_endian ? j : word - 1 - j)]] + 2, 2);
+				p += 2;
+			}
+			*p++ = ',';
+		}
+	}
+	else
+	{
+		for (int i = 0; i < size; ++i)
+		{
+			memcpy(p, HexTable[data[i]], 5);
+			p += 5;
+		}
+	}
+	if (last && size > 0)
+	{
+		p[-1] = '}';
+		*p++ = ';';
+		*p++ = '\n';
+	}
+	*p++ = '\n';
+	ob->len = p - ob->buf;
+}
+
+// Decoders for --compress, written once at the top of the header
+const char DecoderSource[] =
+	"#ifndef CPI2HEX_DECODERS\n"
+	"#define CPI2HEX_DECODERS\n"
+	"\n"
+	"// Decode a glyph of an _rle font, starting at _rle + _rle_offset[c], into lines * line_size bytes\n"
+	"static inline void cpi2hex_rle_glyph(const unsigned char *p, int lines, int line_size, unsigned char *out)\n"
+	"{\n"
+	"\tunsigned char *end = out + lines * line_size;\n"
+	"\twhile (out < end)\n"
+	"\t{\n"
+	"\t\tint code = *p++;\n"
+	"\t\tint n = (code & (code & 0x80 ? 0x3F : 0x7F)) + 1;\n"
+	"\t\tfor (int i = 0; i < n * line_size; ++i)\n"
+	"\t\t\t*out++ = code < 0x80 ? *p++ : (code < 0xC0 ? 0 : p[i % line_size]);\n"
+	"\t\tif (code >= 0xC0)\n"
+	"\t\t\tp += line_size;\n"
+	"\t}\n"
+	"}\n"
+	"\n"
+	"// Decode glyph c of a _dict font, its _lines table holding 8 or 16 bit (wide) entries\n"
+	"static inline void cpi2hex_dict_glyph(const unsigned char *dict, const void *index, int wide, int c, int lines, int line_size, unsigned char *out)\n"
+	"{\n"
+	"\tfor (int i = c * lines; i < (c + 1) * lines; ++i)\n"
+	"\t{\n"
+	"\t\tconst unsigned char *line = dict + (wide ? ((const uint16_t *)index)[i] : ((const uint8_t *)index)[i]) * line_size;\n"
+	"\t\tfor (int j = 0; j < line_size; ++j)\n"
+	"\t\t\t*out++ = line[j];\n"
+	"\t}\n"
+	"}\n"
+	"\n"
+	"#endif\n"
+	"\n";
+
+// Lookup for -u, written once at the top of the header
+const char UnicodeSource[] =
+	"#ifndef CPI2HEX_UNICODE\n"
+	"#define CPI2HEX_UNICODE\n"
+	"\n"
+	"// Position of code point u in a sorted _codes table, or -1. Its glyph is _glyphs[position].\n"
+	"static inline int cpi2hex_unicode_find(const uint16_t *codes, int count, unsigned int u)\n"
+	"{\n"
+	"\tint lo = 0, hi = count - 1;\n"
+	"\twhile (lo <= hi)\n"
+	"\t{\n"
+	"\t\tint mid = (lo + hi) / 2;\n"
+	"\t\tif (codes[mid] == u)\n"
+	"\t\t\treturn mid;\n"
+	"\t\tif (codes[mid] < u)\n"
+	"\t\t\tlo = mid + 1;\n"
+	"\t\telse\n"
+	"\t\t\thi = mid - 1;\n"
+	"\t}\n"
+	"\treturn -1;\n"
+	"}\n"
+	"\n"
+	"#endif\n"
+	"\n";
+
+struct OutputBuffer HeaderOut;
+char HeaderName[PATH_SIZE]; // Set while the header is being built
+
+// Start collecting output for name, written out by close_header
+void open_output(const char *name)
+{
+	if (HeaderName[0])
+		return;
+
+	snprintf(HeaderName, sizeof(HeaderName), "%s", name);
+	HeaderOut.len = 0;
+}
+
+// Start a C header, with whatever it needs ahead of the fonts
+void open_header(const char *name)
+{
+	if (HeaderName[0])
+		return;
+
+	open_output(name);
+	if (options.word > 1 || options.output == OUTPUT_SHARED || options.output == OUTPUT_UNICODE || options.compress)
+		out_str(&HeaderOut, "#include <stdint.h>\n\n");
+	if (options.compress)
+		out_str(&HeaderOut, DecoderSource);
+	if (options.output == OUTPUT_UNICODE)
+		out_str(&HeaderOut, UnicodeSource);
+}
+
+// Write the header once complete. Header output with no fonts leaves no header behind.
+void close_header(const char *outfile)
+{
+	if (HeaderName[0])
+		commit_output(HeaderName, HeaderOut.buf, HeaderOut.len);
+	else if (options.output != OUTPUT_BINARY && !options.stream)
+	{
+		remove(outfile);
+		Counting->syscalls++;
+	}
+	HeaderName[0] = 0;
+}
+
+// C type of the output arrays
+const char *data_type(void)
+{
+	return options.word == 4 ? "uint32_t" : (options.word == 2 ? "uint16_t" : "unsigned char");
+}
+
+// Array length of a font of size bytes
+int data_count(int size)
+{
+	return options.word > 1 ? size / options.word : size;
+}
+
+// A font to be extracted, collected while walking the code page entry chain
+struct FontEntry
+{
+	int cp_index;       // Position of the code page in the entry chain
+	int selected;       // Matches the -c code page
+	int codepage;
+	int device_type;
+	char device_name[8];
+	struct cpi_font font; // Views into CpiFile are set once the font is checked
+	int glyph_size;     // Bytes per glyph once transformed for output
+	int size;           // Bytes of bitmap data extracted
+	int packed;         // Bytes written with --compress, and bytes read to decode every glyph
+	long reads;
+	struct OutputBuffer out;
+	struct Counters stats;
+};
+
+struct
+{
+	struct FontEntry *entry;
+	int count;
+	int size;
+} FontTable;
+
+struct FontEntry *add_font(void)
+{
+	if (FontTable.count == FontTable.size)
+	{
+		int size = FontTable.size ? FontTable.size * 2 : 64;
+		struct FontEntry *entry = (struct FontEntry *)realloc(FontTable.entry, sizeof(struct FontEntry) * size);
+		if (entry == NULL)
+		{
+			printf("Error: Out of memory\n");
+			exit(1);
+		}
+		memset(entry + FontTable.size, 0, sizeof(struct FontEntry) * (size - FontTable.size));
+		FontTable.entry = entry;
+		FontTable.size = size;
+	}
+
+	struct FontEntry *entry = &FontTable.entry[FontTable.count++];
+	entry->out.len = 0;
+	memset(&entry->stats, 0, sizeof(entry->stats));
+	return entry;
+}
+
+// Add or remove (with a leading ^) the comma separated ranges of a -r argument
+void add_selection(char *arg)
+{
+	char *item = strtok(arg, ",");
+	while (item != NULL)
+	{
+		int exclude = item[0] == '^';
+		char *p = item + exclude;
+		char *end;
+		long first = strtol(p, &end, 10);
+		long last = first;
+		if (end == p)
+		{
+			printf("Error: Invalid argument '%s' after -r\n", item);
+			exit(1);
+		}
+		if (*end == '-')
+		{
+			p = end + 1;
+			last = *p ? strtol(p, &end, 10) : MAX_CHARS - 1;
+			if (*p == 0)
+			{
+				end = p;
+				if (!exclude && first < Selection.open_from)
+					Selection.open_from = (int)first;
+			}
+		}
+		if (*end != 0 || first < 0)
+		{
+			printf("Error: Invalid argument '%s' after -r\n", item);
+			exit(1);
+		}
+		if (last < first)
+		{
+			printf("Error: Ending range can not be smaller than starting range\n");
+			exit(1);
+		}
+		if (last > MAX_CHARS - 1)
+			last = MAX_CHARS - 1;
+
+		// Leaving characters out of nothing means leaving them out of the whole font
+		if (exclude && !Selection.used)
+		{
+			memset(Selection.bits, 0xFF, sizeof(Selection.bits));
+			Selection.open_from = 0;
+		}
+		Selection.used = 1;
+
+		for (long c = first; c <= last; ++c)
+		{
+			if (exclude)
+				Selection.bits[c >> 3] &= ~(1 << (c & 7));
+			else
+				Selection.bits[c >> 3] |= 1 << (c & 7);
+		}
+		item = strtok(NULL, ",");
+	}
+}
+
+// Turn the selection into runs once, so output loops never test single characters
+void select_runs(void)
+{
+	Selection.num_runs = 0;
+	if (!Selection.used)
+		return;
+
+	for (int c = 0; c < MAX_CHARS; ++c)
+	{
+		if (!(Selection.bits[c >> 3] & (1 << (c & 7))))
+			continue;
+		if (Selection.num_runs && Selection.run[Selection.num_runs - 1][1] == c - 1)
+		{
+			Selection.run[Selection.num_runs - 1][1] = c;
+			continue;
+		}
+		if ((Selection.num_runs & 63) == 0)
+		{
+			Selection.run = (int (*)[2])realloc(Selection.run, sizeof(int[2]) * (Selection.num_runs + 64));
+			if (Selection.run == NULL)
+			{
+				printf("Error: Out of memory\n");
+				exit(1);
+			}
+		}
+		Selection.run[Selection.num_runs][0] = c;
+		Selection.run[Selection.num_runs][1] = c;
+		Selection.num_runs++;
+	}
+
+	if (Selection.num_runs == 0)
+	{
+		printf("Error: No characters selected with -r\n");
+		exit(1);
+	}
+}
+
+// Highest character that must be in every font, ranges running to the end of the font aside
+int max_selected_char(void)
+{
+	int max = -1;
+	for (int num = 0; num < Selection.num_runs && Selection.run[num][0] < Selection.open_from; ++num)
+		max = Selection.run[num][1] < Selection.open_from ? Selection.run[num][1] : Selection.open_from - 1;
+	return max;
+}
+
+// Run num of the selected characters of a font, returning 0 after the last one
+int font_run(const struct FontEntry *entry, int num, int *first, int *last)
+{
+	int num_chars = entry->font.num_chars;
+
+	if (!Selection.used)
+	{
+		*first = 0;
+		*last = num_chars - 1;
+		return num == 0 && num_chars > 0;
+	}
+	if (num >= Selection.num_runs || Selection.run[num][0] >= num_chars)
+		return 0;
+
+	*first = Selection.run[num][0];
+	*last = Selection.run[num][1] < num_chars ? Selection.run[num][1] : num_chars - 1;
+	return 1;
+}
+
+int selected_chars(const struct FontEntry *entry)
+{
+	int count = 0, first, last;
+	for (int num = 0; font_run(entry, num, &first, &last); ++num)
+		count += last - first + 1;
+	return count;
+}
+
+// Prepended to binary output names so that files from different inputs don't collide
+char OutputPrefix[PATH_SIZE];
+
+// Width and height of a glyph once rotated
+void output_dims(const struct cpi_font *font, int *width, int *height)
+{
+	*width = options.transpose ? font->height : font->width;
+	*height = options.transpose ? font->width : font->height;
+}
+
+void font_symbol(char *name, const struct FontEntry *entry)
+{
+	int width, height;
+	output_dims(&entry->font, &width, &height);
+	sprintf(name, "CP%i_%ix%i__%ibpp", entry->codepage, width, height, options.bpp);
+}
+
+#define GLYPH_BUFFER_SIZE (256 * 256)
+
+// Glyphs are copied as stored unless an output transform is given
+int transformed(void)
+{
+	return options.layout != LAYOUT_ROWS || options.transpose || options.orient || options.pack;
+}
+
+// Bytes per output row, padded to whole words with --word
+int row_size(int width)
+{
+	int row_bytes = (width * options.bpp + 7) / 8;
+	if (options.word > 1)
+		row_bytes = (row_bytes + options.word - 1) / options.word * options.word;
+	return row_bytes;
+}
+
+int glyph_size(const struct cpi_font *font)
+{
+	int width, height;
+	output_dims(font, &width, &height);
+
+	if (options.layout != LAYOUT_ROWS)
+		return width * ((height + 7) / 8);
+	return height * row_size(width);
+}
+
+// Transpose 8x8 pixels held a row per byte, with row 0 in the low byte and the leftmost
+// pixel in bit 7, into a column per byte from the high byte down with the top pixel in bit 0
+unsigned long long transpose8(unsigned long long x)
+{
+	unsigned long long t;
+
+	t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+	x = x ^ t ^ (t << 7);
+	t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+	x = x ^ t ^ (t << 14);
+	t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+	x = x ^ t ^ (t << 28);
+	return x;
+}
+
+unsigned char BitReverse[256];
+
+// The bpp output bytes of each input byte of 8 pixels
+unsigned char Expand[256][8];
+
+void init_bit_reverse(void)
+{
+	for (int i = 0; i < 256; ++i)
+	{
+		unsigned char b = (unsigned char)i;
+		b = (unsigned char)((b & 0xF0) >> 4 | (b & 0x0F) << 4);
+		b = (unsigned char)((b & 0xCC) >> 2 | (b & 0x33) << 2);
+		BitReverse[i] = (unsigned char)((b & 0xAA) >> 1 | (b & 0x55) << 1);
+	}
+}
+
+void init_expand(void)
+{
+	int per_byte = 8 / options.bpp;
+	memset(Expand, 0, sizeof(Expand));
+	for (int i = 0; i < 256; ++i)
+	{
+		for (int pixel = 0; pixel < 8; ++pixel)
+		{
+			int value = (i >> (7 - pixel)) & 1 ? options.fg : options.bg;
+			int slot = pixel % per_byte;
+			int shift = options.lsb_first ? slot * options.bpp : 8 - options.bpp - slot * options.bpp;
+			Expand[i][pixel / per_byte] |= (unsigned char)(value << shift);
+		}
+	}
+}
+
+// Rotate and flip a glyph held as rows. Rotations are a transpose of 8x8 pixel blocks,
+// followed by a horizontal (90) or vertical (270) flip.
+void orient_glyph(const struct cpi_font *font, const unsigned char *data, unsigned char *out)
+{
+	int width = font->width;
+	int height = font->height;
+	int row_bytes = (width + 7) / 8;
+
+	if (options.transpose)
+	{
+		// With row 0 in the high byte the transposed columns come out as rows, leftmost pixel in bit 7
+		int out_bytes = (height + 7) / 8;
+		for (int block = 0; block < out_bytes; ++block)
+		{
+			int rows = height - block * 8 < 8 ? height - block * 8 : 8;
+			for (int col = 0; col < row_bytes; ++col)
+			{
+				unsigned long long x = 0;
+				for (int row = 0; row < rows; ++row)
+					x |= (unsigned long long)data[(block * 8 + row) * row_bytes + col] << ((7 - row) * 8);
+				x = transpose8(x);
+
+				for (int i = 0; i < 8 && col * 8 + i < width; ++i)
+					out[(col * 8 + i) * out_bytes + block] = (unsigned char)(x >> (56 - i * 8));
+			}
+		}
+		width = font->height;
+		height = font->width;
+		row_bytes = out_bytes;
+	}
+	else
+		memcpy(out, data, (size_t)height * row_bytes);
+
+	if (options.orient & FLIP_V)
+	{
+		for (int top = 0, bottom = height - 1; top < bottom; ++top, --bottom)
+		{
+			for (int i = 0; i < row_bytes; ++i)
+			{
+				unsigned char b = out[top * row_bytes + i];
+				out[top * row_bytes + i] = out[bottom * row_bytes + i];
+				out[bottom * row_bytes + i] = b;
+			}
+		}
+	}
+
+	if (options.orient & FLIP_H)
+	{
+		// Mirror each row, then shift the padding bits back to the right hand end
+		int pad = row_bytes * 8 - width;
+		for (int row = 0; row < height; ++row)
+		{
+			unsigned char mirror[32];
+			unsigned char *p = out + row * row_bytes;
+			for (int i = 0; i < row_bytes; ++i)
+				mirror[i] = BitReverse[p[row_bytes - 1 - i]];
+			for (int i = 0; i < row_bytes; ++i)
+				p[i] = (unsigned char)((mirror[i] << pad) | (i + 1 < row_bytes && pad ? mirror[i + 1] >> (8 - pad) : 0));
+		}
+	}
+}
+
+// Lay a glyph out as vertical 8 pixel bytes like SSD1306 style controllers take them,
+// either a page (band of 8 rows) at a time or a column at a time
+void layout_glyph(int width, int height, const unsigned char *data, unsigned char *out)
+{
+	int row_bytes = (width + 7) / 8;
+	int pages = (height + 7) / 8;
+
+	for (int page = 0; page < pages; ++page)
+	{
+		int rows = height - page * 8 < 8 ? height - page * 8 : 8;
+		for (int col = 0; col < row_bytes; ++col)
+		{
+			unsigned long long x = 0;
+			for (int row = 0; row < rows; ++row)
+				x |= (unsigned long long)data[(page * 8 + row) * row_bytes + col] << (row * 8);
+			x = transpose8(x);
+
+			for (int i = 0; i < 8 && col * 8 + i < width; ++i)
+			{
+				int column = col * 8 + i;
+				unsigned char b = (unsigned char)(x >> (56 - i * 8));
+				if (options.layout == LAYOUT_PAGES)
+					out[page * width + column] = b;
+				else
+					out[column * pages + page] = b;
+			}
+		}
+	}
+}
+
+// Expand and pack rows with --bpp, --bits and --word. Each input byte becomes bpp bytes through
+// Expand, which also puts the pixels in order within each byte. An MSB first big endian word is
+// then the row as it is, padded to a whole word, and the bytes of each word are reversed for
+// MSB first little endian and for LSB first big endian.
+void pack_glyph(int width, int height, const unsigned char *data, unsigned char *out)
+{
+	int in_bytes = (width + 7) / 8;
+	int out_bytes = row_size(width);
+	int used = width * options.bpp / 8;
+	int tail = width * options.bpp % 8;
+	unsigned char mask = (unsigned char)(options.lsb_first ? 0xFF >> (8 - tail) : 0xFF << (8 - tail));
+	int swap = options.word > 1 && options.lsb_first == options.big_endian ? options.word - 1 : 0;
+
+	for (int row = 0; row < height; ++row)
+	{
+		const unsigned char *src = data + row * in_bytes;
+		unsigned char *dst = out + row * out_bytes;
+		for (int i = 0; i < out_bytes; ++i)
+		{
+			unsigned char b = 0;
+			if (i < used)
+				b = Expand[src[i / options.bpp]][i % options.bpp];
+			else if (i == used && tail)
+				b = Expand[src[i / options.bpp]][i % options.bpp] & mask; // Padding stays clear
+			dst[i ^ swap] = b;
+		}
+	}
+}
+
+// Glyph of character c as it is output, transformed through buf if need be
+const unsigned char *output_glyph(const struct FontEntry *entry, int c, unsigned char (*buf)[GLYPH_BUFFER_SIZE])
+{
+	const unsigned char *data = cpi_glyph(&entry->font, c);
+
+	if (options.transpose || options.orient)
+	{
+		orient_glyph(&entry->font, data, buf[0]);
+		data = buf[0];
+	}
+	if (options.layout != LAYOUT_ROWS)
+	{
+		int width, height;
+		output_dims(&entry->font, &width, &height);
+		layout_glyph(width, height, data, buf[1]);
+		data = buf[1];
+	}
+	else if (options.pack)
+	{
+		int width, height;
+		output_dims(&entry->font, &width, &height);
+		pack_glyph(width, height, data, buf[1]);
+		data = buf[1];
+	}
+	return data;
+}
+
+// Scratch space for output_glyph. At 128 KB it is kept off the stack, as fonts are extracted
+// on worker threads.
+unsigned char (*glyph_buffers(void))[GLYPH_BUFFER_SIZE]
+{
+	unsigned char (*buf)[GLYPH_BUFFER_SIZE] = (unsigned char (*)[GLYPH_BUFFER_SIZE])malloc(2 * GLYPH_BUFFER_SIZE);
+	if (buf == NULL)
+	{
+		printf("Error: Out of memory\n");
+		exit(1);
+	}
+	return buf;
+}
+
+// Append the selected characters of a font as raw bitmap bytes, a whole run at a time
+// unless glyphs are gathered through a DR-DOS index table or transformed
+void gather_font(const struct FontEntry *entry, struct OutputBuffer *ob)
+{
+	int first, last;
+
+	if (transformed())
+	{
+		unsigned char (*buf)[GLYPH_BUFFER_SIZE] = glyph_buffers();
+		for (int num = 0; font_run(entry, num, &first, &last); ++num)
+		{
+			for (int c = first; c <= last; ++c)
+				out_write(ob, output_glyph(entry, c, buf), entry->glyph_size);
+		}
+		free(buf);
+		return;
+	}
+
+	for (int num = 0; font_run(entry, num, &first, &last); ++num)
+	{
+		if (entry->font.index == NULL)
+		{
+			out_write(ob, cpi_glyph(&entry->font, first), (size_t)(last - first + 1) * entry->font.stride);
+			continue;
+		}
+		for (int c = first; c <= last; ++c)
+			out_write(ob, cpi_glyph(&entry->font, c), entry->font.stride);
+	}
+}
+
+// Copy part of the input file to fd, within the kernel when the input is mapped straight
+// from a file, otherwise from memory. Returns 0 if it can't all be written.
+int copy_input(int fd, long offset, long len)
+{
+#ifdef __linux__
+	while (len > 0 && CpiFile.mapped == CPI_MAPPED && InputFd >= 0)
+	{
+		if (offset != InputNext)
+			Counting->seeks++;
+		loff_t in = offset;
+		long n = (long)copy_file_range(InputFd, &in, fd, NULL, len, 0);
+		Counting->syscalls++;
+		if (n <= 0)
+		{
+			// Older kernels can't copy between file systems
+			off_t at = offset;
+			n = (long)sendfile(fd, InputFd, &at, len);
+			Counting->syscalls++;
+		}
+		if (n <= 0)
+			break;
+		Counting->bytes_written += n;
+		offset += n;
+		len -= n;
+		InputNext = offset;
+	}
+#endif
+	return write_all(fd, CpiFile.data + offset, len);
+}
+
+// 32-bit FNV-1a hash of a glyph, for finding repeated glyphs
+unsigned long hash_glyph(const unsigned char *data, int len)
+{
+	unsigned long hash = 2166136261UL; // FNV-1a
+	for (int i = 0; i < len; ++i)
+		hash = ((hash ^ data[i]) * 16777619UL) & 0xFFFFFFFFUL;
+	return hash;
+}
+
+void out_number_table(struct OutputBuffer *ob, const char *type, const char *name, const int *values, int count)
+{
+	char line[128];
+
+	sprintf(line, "const %s %s[%i] = {\n", type, name, count);
+	out_str(ob, line);
+	for (int i = 0; i < count; ++i)
+	{
+		sprintf(line, "%i%s", values[i], i == count - 1 ? "};\n\n" : ((i & 15) == 15 ? ",\n" : ","));
+		out_str(ob, line);
+	}
+}
+
+// Glyphs are compressed a line at a time: rows, or the columns or pages of --layout
+void glyph_lines(const struct FontEntry *entry, int *line_size, int *lines)
+{
+	int width, height;
+	output_dims(&entry->font, &width, &height);
+
+	if (options.layout == LAYOUT_COLUMNS)
+		*line_size = (height + 7) / 8, *lines = width;
+	else if (options.layout == LAYOUT_PAGES)
+		*line_size = width, *lines = (height + 7) / 8;
+	else
+		*line_size = row_size(width), *lines = height;
+}
+
+int blank_line(const unsigned char *line, int size)
+{
+	for (int i = 0; i < size; ++i)
+	{
+		if (line[i])
+			return 0;
+	}
+	return 1;
+}
+
+// Number of lines from line i equal to it, up to the 64 of a run code
+int repeat_run(const unsigned char *glyph, int line_size, int lines, int i)
+{
+	const unsigned char *line = glyph + i * line_size;
+	int run = 1;
+	while (i + run < lines && run < 64 && memcmp(line, line + run * line_size, line_size) == 0)
+		++run;
+	return run;
+}
+
+// Run length code the lines of one glyph. Each code byte is followed by its lines:
+//   0x00-0x7F  1 to 128 literal lines
+//   0x80-0xBF  1 to 64 blank lines, with no data
+//   0xC0-0xFF  1 to 64 copies of the one line that follows
+// A literal only stops for a run that saves more than the two code bytes it costs, or for the
+// blank lines at the bottom of the glyph.
+void rle_glyph(struct OutputBuffer *ob, const unsigned char *glyph, int line_size, int lines)
+{
+	for (int i = 0; i < lines;)
+	{
+		const unsigned char *line = glyph + i * line_size;
+		int run = repeat_run(glyph, line_size, lines, i);
+		unsigned char code;
+
+		if (blank_line(line, line_size))
+		{
+			code = (unsigned char)(0x80 | (run - 1));
+			out_write(ob, &code, 1);
+		}
+		else if (run > 1)
+		{
+			code = (unsigned char)(0xC0 | (run - 1));
+			out_write(ob, &code, 1);
+			out_write(ob, line, line_size);
+		}
+		else
+		{
+			run = 1;
+			while (i + run < lines && run < 128)
+			{
+				int next = repeat_run(glyph, line_size, lines, i + run);
+				if (blank_line(line + run * line_size, line_size) ? (next * line_size > 2 || i + run + next == lines) : (next - 1) * line_size > 2)
+					break;
+				++run;
+			}
+			code = (unsigned char)(run - 1);
+			out_write(ob, &code, 1);
+			out_write(ob, line, (size_t)run * line_size);
+		}
+		i += run;
+	}
+}
+
+// Write a font as a compressed stream with an offset per glyph (rle), or as a table of unique
+// lines with an index per line (dict), either of which decodes a glyph in O(lines). The flat
+// and compressed sizes and the bytes read to decode each glyph are kept for the summary.
+void compress_font(struct FontEntry *entry, struct OutputBuffer *ob, const char *symbol)
+{
+	struct OutputBuffer flat = { 0 };
+	struct OutputBuffer data = { 0 };
+	char name[96];
+	char line[256];
+	int line_size, lines;
+	int count = entry->glyph_size ? entry->size / entry->glyph_size : 0;
+
+	gather_font(entry, &flat);
+	glyph_lines(entry, &line_size, &lines);
+	int *table = (int *)malloc(sizeof(int) * ((size_t)count * lines + 1));
+	if (table == NULL)
+	{
+		printf("Error: Out of memory\n");
+		exit(1);
+	}
+
+	if (options.compress == COMPRESS_RLE)
+	{
+		for (int g = 0; g < count; ++g)
+		{
+			table[g] = (int)data.len;
+			rle_glyph(&data, (const unsigned char *)flat.buf + (size_t)g * entry->glyph_size, line_size, lines);
+		}
+		const char *type = data.len > 65535 ? "uint32_t" : "uint16_t";
+		entry->packed = (int)data.len + count * (data.len > 65535 ? 4 : 2);
+		entry->reads = (long)data.len + count * (data.len > 65535 ? 4 : 2);
+
+		sprintf(line, "// Glyph c: cpi2hex_rle_glyph(%s_rle + %s_rle_offset[c], %i, %i, out)\n", symbol, symbol, lines, line_size);
+		out_str(ob, line);
+		sprintf(line, "const unsigned char %s_rle[%i] = {\n", symbol, (int)data.len);
+		out_str(ob, line);
+		for (int g = 0; g < count; ++g)
+		{
+			int end = g + 1 < count ? table[g + 1] : (int)data.len;
+			out_glyph(ob, (const unsigned char *)data.buf + table[g], end - table[g], 1, g == count - 1);
+		}
+		sprintf(name, "%s_rle_offset", symbol);
+		out_number_table(ob, type, name, table, count);
+	}
+	else
+	{
+		// Open addressing table of unique lines, as write_shared does for whole glyphs
+		int total = count * lines;
+		int num_slots = 64;
+		while (num_slots < total * 2)
+			num_slots *= 2;
+		int *slots = (int *)malloc(sizeof(int) * num_slots);
+		if (slots == NULL)
+		{
+			printf("Error: Out of memory\n");
+			exit(1);
+		}
+		memset(slots, 0xFF, sizeof(int) * num_slots);
+
+		int unique = 0;
+		for (int n = 0; n < total; ++n)
+		{
+			const unsigned char *p = (const unsigned char *)flat.buf + (size_t)n * line_size;
+			unsigned long slot = hash_glyph(p, line_size) & (num_slots - 1);
+			while (slots[slot] >= 0 && memcmp(data.buf + (size_t)slots[slot] * line_size, p, line_size) != 0)
+				slot = (slot + 1) & (num_slots - 1);
+			if (slots[slot] < 0)
+			{
+				slots[slot] = unique++;
+				out_write(&data, p, line_size);
+			}
+			table[n] = slots[slot];
+		}
+		free(slots);
+
+		int wide = unique > 256;
+		entry->packed = (int)data.len + total * (wide ? 2 : 1);
+		entry->reads = (long)count * lines * (line_size + (wide ? 2 : 1));
+
+		sprintf(line, "// Glyph c: cpi2hex_dict_glyph(%s_dict, %s_lines, %i, c, %i, %i, out)\n", symbol, symbol, wide, lines, line_size);
+		out_str(ob, line);
+		sprintf(line, "const unsigned char %s_dict[%i] = {\n", symbol, (int)data.len);
+		out_str(ob, line);
+		for (int n = 0; n < unique; ++n)
+			out_glyph(ob, (const unsigned char *)data.buf + (size_t)n * line_size, line_size, 1, n == unique - 1);
+		sprintf(name, "%s_lines", symbol);
+		out_number_table(ob, wide ? "uint16_t" : "uint8_t", name, table, total);
+	}
+
+	free(table);
+	free(flat.buf);
+	free(data.buf);
+}
+
+// Report the compression of each font, to help pick a scheme per font size
+void print_compression(void)
+{
+	static const char *scheme[] = { "", "rle", "dict" };
+
+	for (int i = 0; i < FontTable.count; ++i)
+	{
+		const struct FontEntry *entry = &FontTable.entry[i];
+		int count = entry->glyph_size ? entry->size / entry->glyph_size : 0;
+		int width, height;
+		output_dims(&entry->font, &width, &height);
+		printf("CP%i %ix%i\t%s: %i -> %i bytes (%.1f%%), %.1f bytes read per glyph\n", entry->codepage, width, height,
+			scheme[options.compress], entry->size, entry->packed, entry->size ? 100.0 * entry->packed / entry->size : 0.0,
+			count ? (double)entry->reads / count : 0.0);
+	}
+	printf("\n");
+}
+
+// Format or write out a single font. Only reads shared state, so fonts can be extracted concurrently
+void extract_font(struct FontEntry *entry, struct OutputBuffer *ob)
+{
+	int first, last;
+	int count = selected_chars(entry);
+
+	char symbol[64];
+	font_symbol(symbol, entry);
+	entry->size = entry->glyph_size * count;
+
+	if (options.output == OUTPUT_ELF || options.output == OUTPUT_SHARED || options.output == OUTPUT_UNICODE)
+	{
+		entry->out.len = 0;
+		gather_font(entry, &entry->out);
+	}
+	else if (options.stream && options.output == OUTPUT_BINARY)
+		gather_font(entry, ob);
+	else if (options.output != OUTPUT_HEADER)
+	{
+		char outfile[PATH_SIZE];
+		path_printf(outfile, "%s%s.bin", OutputPrefix, symbol);
+		if (entry->font.index == NULL && !transformed() && !Cache.recording)
+		{
+			dep_add(outfile);
+			double start = stats_clock();
+
+			// Each run of a contiguous font is a straight copy of part of the input, made only if
+			// the file doesn't already hold it
+			unsigned char *existing = read_existing(outfile, entry->size);
+			int same = existing != NULL;
+			long pos = 0;
+			for (int num = 0; same && font_run(entry, num, &first, &last); ++num)
+			{
+				long len = (long)(last - first + 1) * entry->font.stride;
+				same = memcmp(existing + pos, CpiFile.data + entry->font.bitmap_offset + (long)first * entry->font.stride, len) == 0;
+				pos += len;
+			}
+			free(existing);
+			if (!same)
+			{
+				char tmp[PATH_SIZE + 32];
+				temp_name(tmp, outfile);
+				int out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+				Counting->syscalls++;
+				if (out < 0)
+				{
+					printf("Error: Could not open output file %s\n", outfile);
+					exit(1);
+				}
+				int ok = 1;
+				for (int num = 0; ok && font_run(entry, num, &first, &last); ++num)
+					ok = copy_input(out, entry->font.bitmap_offset + (long)first * entry->font.stride, (long)(last - first + 1) * entry->font.stride);
+				ok = close(out) == 0 && ok;
+				Counting->syscalls++;
+				if (!ok)
+					remove(tmp);
+				if (!ok || !replace_file(tmp, outfile))
+				{
+					printf("Error: Could not write output file %s\n", outfile);
+					exit(1);
+				}
+			}
+			Counting->write += stats_clock() - start;
+		}
+		else
+		{
+			entry->out.len = 0;
+			gather_font(entry, &entry->out);
+			commit_output(outfile, entry->out.buf, entry->out.len);
+		}
+	}
+	else if (options.compress)
+		compress_font(entry, ob, symbol);
+	else
+	{
+		char line[128];
+		sprintf(line, "const %s %s[%i] = {\n", data_type(), symbol, data_count(entry->size));
+		out_str(ob, line);
+		unsigned char (*buf)[GLYPH_BUFFER_SIZE] = glyph_buffers();
+		int written = 0;
+		for (int num = 0; font_run(entry, num, &first, &last); ++num)
+		{
+			for (int c = first; c <= last; ++c)
+				out_glyph(ob, output_glyph(entry, c, buf), entry->glyph_size, options.word, ++written == count);
+		}
+		free(buf);
+	}
+}
+
+int NextJob;
+
+#ifdef _WIN32
+unsigned __stdcall job_worker(void *arg)
+#else
+void *job_worker(void *arg)
+#endif
+{
+	for (;;)
+	{
+		job_lock();
+		int job = NextJob++;
+		job_unlock();
+		if (job >= FontTable.count)
+			break;
+
+		// Time spent writing files is counted by the writes themselves, the rest is formatting
+		struct FontEntry *entry = &FontTable.entry[job];
+		struct Counters *outer = Counting;
+		double start = stats_clock();
+		Counting = &entry->stats;
+		InputNext = -1;
+		extract_font(entry, arg ? &entry->out : &HeaderOut);
+		Counting = outer;
+		entry->stats.format += stats_clock() - start - entry->stats.write;
+		int count = selected_chars(entry);
+		entry->stats.glyphs += count;
+		entry->stats.bytes_read += (long long)count * entry->font.stride;
+	}
+	return 0;
+}
+
+// Extract every font in FontTable. With more than one job, header text is formatted into
+// per-font buffers on worker threads and then appended in table order, so the output
+// matches a serial run byte for byte.
+void run_jobs(const char *outfile)
+{
+	int threads = options.jobs < FontTable.count ? options.jobs : FontTable.count;
+
+	if (FontTable.count == 0)
+		return;
+	if (options.output == OUTPUT_HEADER)
+		open_header(outfile);
+	else if (options.stream && options.output == OUTPUT_BINARY)
+		open_output(outfile);
+
+	NextJob = 0;
+	if (threads <= 1)
+	{
+		job_worker(NULL);
+		return;
+	}
+
+#ifdef _WIN32
+	HANDLE *pool = (HANDLE *)malloc(sizeof(HANDLE) * threads);
+#else
+	pthread_t *pool = (pthread_t *)malloc(sizeof(pthread_t) * threads);
+#endif
+	if (pool == NULL)
+	{
+		printf("Error: Out of memory\n");
+		exit(1);
+	}
+
+	for (int i = 0; i < threads; ++i)
+	{
+#ifdef _WIN32
+		pool[i] = (HANDLE)_beginthreadex(NULL, 0, job_worker, &FontTable, 0, NULL);
+		if (pool[i] == 0)
+#else
+		if (pthread_create(&pool[i], NULL, job_worker, &FontTable) != 0)
+#endif
+		{
+			printf("Error: Could not start worker thread\n");
+			exit(1);
+		}
+	}
+	for (int i = 0; i < threads; ++i)
+	{
+#ifdef _WIN32
+		WaitForSingleObject(pool[i], INFINITE);
+		CloseHandle(pool[i]);
+#else
+		pthread_join(pool[i], NULL);
+#endif
+	}
+	free(pool);
+
+	// -s, -u and -l keep the gathered bitmaps of each font for writing afterwards
+	if (options.output == OUTPUT_HEADER || (options.stream && options.output == OUTPUT_BINARY))
+	{
+		for (int i = 0; i < FontTable.count; ++i)
+			out_write(&HeaderOut, FontTable.entry[i].out.buf, FontTable.entry[i].out.len);
+	}
+}
+
+// Replace the extension of name (if any) with ext
+void replace_extension(char *dest, const char *name, const char *ext)
+{
+	const char *dot = strrchr(name, '.');
+	const char *sep = strrchr(name, '/');
+	size_t len = (dot != NULL && (sep == NULL || dot > sep)) ? (size_t)(dot - name) : strlen(name);
+
+	path_printf(dest, "%.*s%s", (int)len, name, ext);
+}
+
+// Write a header with extern declarations for fonts built into an object file
+void write_declarations(const char *outfile)
+{
+	char symbol[64];
+	char line[128];
+
+	open_header(outfile);
+	for (int i = 0; i < FontTable.count; ++i)
+	{
+		font_symbol(symbol, &FontTable.entry[i]);
+		sprintf(line, "extern const %s %s[%i];\n", data_type(), symbol, data_count(FontTable.entry[i].size));
+		out_str(&HeaderOut, line);
+		sprintf(line, "extern const unsigned int %s_size;\n", symbol);
+		out_str(&HeaderOut, line);
+	}
+}
+
+// Write the extracted fonts as a relocatable ELF object with a .rodata symbol and a
+// matching _size symbol per font, plus a header declaring them
+void write_elf(const char *outfile)
+{
+	enum { SH_NULL, SH_RODATA, SH_SYMTAB, SH_STRTAB, SH_SHSTRTAB, SH_NOTE, SH_COUNT };
+	static const char shstrtab[] = "\0.rodata\0.symtab\0.strtab\0.shstrtab\0.note.GNU-stack";
+	static const int shname[SH_COUNT] = { 0, 1, 9, 17, 25, 35 };
+
+	int is64 = options.elf_machine == EM_X86_64;
+	int w = is64 ? 8 : 4;
+	int ehsize = is64 ? 64 : 52;
+	int shentsize = is64 ? 64 : 40;
+	int symentsize = is64 ? 24 : 16;
+	char objfile[PATH_SIZE];
+	char symbol[64];
+	struct OutputBuffer strtab = { 0 };
+	struct OutputBuffer elf = { 0 };
+
+	// Font data is laid out back to back, followed by a 32-bit size word per font
+	unsigned long rodata_size = 0;
+	for (int i = 0; i < FontTable.count; ++i)
+		rodata_size += FontTable.entry[i].out.len;
+	unsigned long sizes_offset = (rodata_size + 3) & ~3UL;
+	rodata_size = sizes_offset + 4UL * FontTable.count;
+
+	int num_symbols = 2 + FontTable.count * 2;
+	unsigned long rodata_offset = (ehsize + 15) & ~15UL;
+	unsigned long symtab_offset = (rodata_offset + rodata_size + 7) & ~7UL;
+	unsigned long strtab_offset = symtab_offset + (unsigned long)num_symbols * symentsize;
+
+	out_write(&strtab, "", 1);
+	for (int i = 0; i < FontTable.count; ++i)
+	{
+		font_symbol(symbol, &FontTable.entry[i]);
+		out_write(&strtab, symbol, strlen(symbol) + 1);
+		out_str(&strtab, symbol);
+		out_write(&strtab, "_size", 6);
+	}
+	unsigned long shstrtab_offset = strtab_offset + strtab.len;
+	unsigned long shoff = (shstrtab_offset + sizeof(shstrtab) + 7) & ~7UL;
+
+	// ELF header
+	out_write(&elf, "\x7F" "ELF", 4);
+	out_le(&elf, is64 ? 2 : 1, 1); // ELFCLASS64 / ELFCLASS32
+	out_le(&elf, 1, 1);            // ELFDATA2LSB
+	out_le(&elf, 1, 1);            // EV_CURRENT
+	out_zero(&elf, 9);             // ELFOSABI_NONE and padding
+	out_le(&elf, 1, 2);            // ET_REL
+	out_le(&elf, options.elf_machine, 2);
+	out_le(&elf, 1, 4);
+	out_le(&elf, 0, w);            // e_entry
+	out_le(&elf, 0, w);            // e_phoff
+	out_le(&elf, shoff, w);
+	out_le(&elf, options.elf_machine == EM_ARM ? 0x05000000 : 0, 4); // EF_ARM_EABI_VER5
+	out_le(&elf, ehsize, 2);
+	out_le(&elf, 0, 2);
+	out_le(&elf, 0, 2);
+	out_le(&elf, shentsize, 2);
+	out_le(&elf, SH_COUNT, 2);
+	out_le(&elf, SH_SHSTRTAB, 2);
+
+	// .rodata
+	out_zero(&elf, rodata_offset - elf.len);
+	for (int i = 0; i < FontTable.count; ++i)
+		out_write(&elf, FontTable.entry[i].out.buf, FontTable.entry[i].out.len);
+	out_zero(&elf, rodata_offset + sizes_offset - elf.len);
+	for (int i = 0; i < FontTable.count; ++i)
+		out_le(&elf, FontTable.entry[i].out.len, 4);
+
+	// .symtab: null symbol and the .rodata section symbol are local, the rest global
+	out_zero(&elf, symtab_offset - elf.len);
+	unsigned long name = 1;
+	unsigned long value = 0;
+	for (int i = -2; i < FontTable.count * 2; ++i)
+	{
+		unsigned long st_name = 0, st_value = 0, st_size = 0;
+		int st_info = 0, st_shndx = 0;
+
+		if (i == -1)
+		{
+			st_info = 3; // STB_LOCAL, STT_SECTION
+			st_shndx = SH_RODATA;
+		}
+		else if (i >= 0)
+		{
+			const struct FontEntry *entry = &FontTable.entry[i / 2];
+			font_symbol(symbol, entry);
+			st_name = name;
+			st_info = (1 << 4) | 1; // STB_GLOBAL, STT_OBJECT
+			st_shndx = SH_RODATA;
+			if (i % 2 == 0)
+			{
+				st_value = value;
+				st_size = entry->out.len;
+				value += entry->out.len;
+				name += strlen(symbol) + 1;
+			}
+			else
+			{
+				st_value = sizes_offset + 4 * (i / 2);
+				st_size = 4;
+				name += strlen(symbol) + 6;
+			}
+		}
+
+		out_le(&elf, st_name, 4);
+		if (is64)
+		{
+			out_le(&elf, st_info, 1);
+			out_le(&elf, 0, 1);
+			out_le(&elf, st_shndx, 2);
+			out_le(&elf, st_value, 8);
+			out_le(&elf, st_size, 8);
+		}
+		else
+		{
+			out_le(&elf, st_value, 4);
+			out_le(&elf, st_size, 4);
+			out_le(&elf, st_info, 1);
+			out_le(&elf, 0, 1);
+			out_le(&elf, st_shndx, 2);
+		}
+	}
+
+	out_write(&elf, strtab.buf, strtab.len);
+	out_write(&elf, shstrtab, sizeof(shstrtab));
+	out_zero(&elf, shoff - elf.len);
+
+	// Section headers
+	for (int sh = 0; sh < SH_COUNT; ++sh)
+	{
+		unsigned long type = 0, flags = 0, offset = 0, size = 0, align = 0, entsize = 0;
+		int link = 0, info = 0;
+
+		switch (sh)
+		{
+		case SH_RODATA:
+			type = 1; flags = 2; offset = rodata_offset; size = rodata_size; align = 4; // SHT_PROGBITS, SHF_ALLOC
+			break;
+		case SH_SYMTAB:
+			type = 2; offset = symtab_offset; size = (unsigned long)num_symbols * symentsize; align = w; entsize = symentsize;
+			link = SH_STRTAB; info = 2; // Index of the first global symbol
+			break;
+		case SH_STRTAB:
+			type = 3; offset = strtab_offset; size = strtab.len; align = 1;
+			break;
+		case SH_SHSTRTAB:
+			type = 3; offset = shstrtab_offset; size = sizeof(shstrtab); align = 1;
+			break;
+		case SH_NOTE:
+			type = 1; offset = shstrtab_offset; align = 1; // Empty, marks the stack as non-executable
+			break;
+		}
+
+		out_le(&elf, shname[sh], 4);
+		out_le(&elf, type, 4);
+		out_le(&elf, flags, w);
+		out_le(&elf, 0, w);
+		out_le(&elf, offset, w);
+		out_le(&elf, size, w);
+		out_le(&elf, link, 4);
+		out_le(&elf, info, 4);
+		out_le(&elf, align, w);
+		out_le(&elf, entsize, w);
+	}
+
+	replace_extension(objfile, outfile, ".o");
+	commit_output(objfile, elf.buf, elf.len);
+	free(elf.buf);
+	free(strtab.buf);
+
+	write_declarations(outfile);
+}
+
+const char *base_name(const char *path)
+{
+	const char *base = path;
+	for (const char *p = path; *p; ++p)
+	{
+		if (*p == '/' || *p == '\\')
+			base = p + 1;
+	}
+	return base;
+}
+
+// Add str as the contents of a quoted assembler string
+void out_asm_string(struct OutputBuffer *ob, const char *str)
+{
+	for (const char *p = str; *p; ++p)
+	{
+		if (*p == '\\' || *p == '"')
+			out_write(ob, "\\", 1);
+		out_write(ob, p, 1);
+	}
+}
+
+// Write an assembler stub pulling the per font .bin files in with .incbin, exporting the
+// same symbols as an ELF object from -l. as looks for .incbin files from the directory it is
+// run in rather than that of the .S file, so the paths are the ones the .bin files were
+// written to, relative to the directory cpi2hex was run in.
+void write_asm(const char *outfile)
+{
+	char asmfile[PATH_SIZE];
+	char symbol[64];
+	char line[512];
+	struct OutputBuffer out = { 0 };
+
+	replace_extension(asmfile, outfile, ".S");
+
+	out_str(&out, "\t.section .rodata\n");
+	for (int i = 0; i < FontTable.count; ++i)
+	{
+		font_symbol(symbol, &FontTable.entry[i]);
+		if (options.word > 1)
+		{
+			sprintf(line, "\n\t.balign %i", options.word);
+			out_str(&out, line);
+		}
+		sprintf(line,
+			"\n\t.global %s\n"
+			"\t.type %s, %%object\n"
+			"%s:\n"
+			"\t.incbin \"",
+			symbol, symbol, symbol);
+		out_str(&out, line);
+		out_asm_string(&out, OutputPrefix);
+		sprintf(line, "%s.bin\"\n\t.size %s, . - %s\n", symbol, symbol, symbol);
+		out_str(&out, line);
+	}
+	out_str(&out, "\n\t.balign 4\n");
+	for (int i = 0; i < FontTable.count; ++i)
+	{
+		font_symbol(symbol, &FontTable.entry[i]);
+		sprintf(line,
+			"\t.global %s_size\n"
+			"\t.type %s_size, %%object\n"
+			"\t.size %s_size, 4\n"
+			"%s_size:\n"
+			"\t.long %i\n",
+			symbol, symbol, symbol, symbol, FontTable.entry[i].size);
+		out_str(&out, line);
+	}
+	out_str(&out, "\n\t.section .note.GNU-stack,\"\",%progbits\n");
+	commit_output(asmfile, out.buf, out.len);
+	free(out.buf);
+
+	write_declarations(outfile);
+}
+
+// Write a header defining each font by #embed-ing its .bin file. Like #include, #embed looks
+// next to the header first, so only the file names are needed.
+void write_embed(const char *outfile)
+{
+	char symbol[64];
+	char line[256];
+
+	open_header(outfile);
+	for (int i = 0; i < FontTable.count; ++i)
+	{
+		font_symbol(symbol, &FontTable.entry[i]);
+		sprintf(line, "const unsigned char %s[%i] = {\n#embed \"", symbol, FontTable.entry[i].size);
+		out_str(&HeaderOut, line);
+		out_str(&HeaderOut, base_name(OutputPrefix));
+		sprintf(line, "%s.bin\"\n};\n\n", symbol);
+		out_str(&HeaderOut, line);
+	}
+}
+
+struct CodePoint
+{
+	int code;
+	int glyph;
+};
+
+int compare_code_points(const void *a, const void *b)
+{
+	return ((const struct CodePoint *)a)->code - ((const struct CodePoint *)b)->code;
+}
+
+// Write one pool of unique glyphs per cell size, shared by all code pages, plus a table per
+// code page mapping its characters to pool entries. With -u the characters are mapped to Unicode
+// instead: each code point keeps the glyph of the first code page that has it, and the tables
+// are a sorted list of code points and the pool entry of each.
+void write_shared(const char *outfile)
+{
+	char name[64];
+	char line[128];
+	struct OutputBuffer pool = { 0 };
+	int *slots = NULL;
+	int *index = NULL;
+	struct CodePoint *points = NULL;
+	int *codes = NULL;
+	static unsigned char mapped[65536 / 8];
+	int unicode = options.output == OUTPUT_UNICODE;
+
+	open_header(outfile);
+
+	for (int first = 0; first < FontTable.count; ++first)
+	{
+		const struct FontEntry *entry = &FontTable.entry[first];
+		int width = entry->font.width;
+		int height = entry->font.height;
+		int stride = entry->glyph_size;
+		int seen = 0;
+		for (int i = 0; i < first && !seen; ++i)
+			seen = FontTable.entry[i].font.width == width && FontTable.entry[i].font.height == height;
+		if (seen || stride == 0)
+			continue;
+
+		// Open addressing table of pool entries, sized for every glyph of this cell size
+		int total = 0, fonts = 0;
+		for (int i = first; i < FontTable.count; ++i)
+		{
+			if (FontTable.entry[i].font.width == width && FontTable.entry[i].font.height == height)
+				total += FontTable.entry[i].size / stride;
+		}
+		int num_slots = 64;
+		while (num_slots < total * 2)
+			num_slots *= 2;
+		slots = (int *)realloc(slots, sizeof(int) * num_slots);
+		index = (int *)realloc(index, sizeof(int) * (total ? total : 1));
+		points = (struct CodePoint *)realloc(points, sizeof(struct CodePoint) * (total ? total : 1));
+		codes = (int *)realloc(codes, sizeof(int) * (total ? total : 1));
+		if (slots == NULL || index == NULL || points == NULL || codes == NULL)
+		{
+			printf("Error: Out of memory\n");
+			exit(1);
+		}
+		memset(slots, 0xFF, sizeof(int) * num_slots);
+		memset(mapped, 0, sizeof(mapped));
+		pool.len = 0;
+
+		int count = 0, n = 0;
+		for (int i = first; i < FontTable.count; ++i)
+		{
+			const struct FontEntry *f = &FontTable.entry[i];
+			const unsigned short *map = unicode ? cpi_unicode(f->codepage) : NULL;
+			int lo, hi;
+			if (f->font.width != width || f->font.height != height)
+				continue;
+			if (unicode && map == NULL)
+			{
+				printf("Code page %i has no Unicode table, skipped\n", f->codepage);
+				continue;
+			}
+			++fonts;
+
+			const unsigned char *glyph = (const unsigned char *)f->out.buf;
+			for (int num = 0; font_run(f, num, &lo, &hi); ++num)
+			{
+				for (int c = lo; c <= hi; ++c, glyph += stride)
+				{
+					int code = 0;
+					if (unicode)
+					{
+						code = c < 256 ? map[c] : 0;
+						if (code == 0 || mapped[code / 8] & (1 << (code % 8)))
+							continue;
+						mapped[code / 8] |= (unsigned char)(1 << (code % 8));
+					}
+
+					unsigned long slot = hash_glyph(glyph, stride) & (num_slots - 1);
+					while (slots[slot] >= 0 && memcmp(pool.buf + (size_t)slots[slot] * stride, glyph, stride) != 0)
+						slot = (slot + 1) & (num_slots - 1);
+					if (slots[slot] < 0)
+					{
+						slots[slot] = count++;
+						out_write(&pool, glyph, stride);
+					}
+					points[n].code = code;
+					points[n].glyph = slots[slot];
+					index[n++] = slots[slot];
+				}
+			}
+		}
+
+		int out_width, out_height;
+		output_dims(&entry->font, &out_width, &out_height);
+		sprintf(name, "%s_%ix%i__%ibpp", unicode ? "UNICODE" : "GLYPHS", out_width, out_height, options.bpp);
+		sprintf(line, "const %s %s[%i] = {\n", data_type(), name, data_count(count * stride));
+		out_str(&HeaderOut, line);
+		for (int g = 0; g < count; ++g)
+			out_glyph(&HeaderOut, (const unsigned char *)pool.buf + (size_t)g * stride, stride, options.word, g == count - 1);
+
+		if (unicode)
+		{
+			qsort(points, n, sizeof(struct CodePoint), compare_code_points);
+			for (int i = 0; i < n; ++i)
+				codes[i] = points[i].code, index[i] = points[i].glyph;
+			sprintf(name, "UNICODE_%ix%i__codes", out_width, out_height);
+			out_number_table(&HeaderOut, "uint16_t", name, codes, n);
+			sprintf(name, "UNICODE_%ix%i__glyphs", out_width, out_height);
+			out_number_table(&HeaderOut, count > 256 ? "uint16_t" : "uint8_t", name, index, n);
+
+			printf("%ix%i\t%i code points from %i code pages in %i unique glyphs (%i bytes)\n", out_width, out_height, n, fonts,
+				count, count * stride + n * (count > 256 ? 4 : 3));
+			continue;
+		}
+
+		n = 0;
+		for (int i = first; i < FontTable.count; ++i)
+		{
+			const struct FontEntry *f = &FontTable.entry[i];
+			if (f->font.width != width || f->font.height != height)
+				continue;
+			sprintf(name, "CP%i_%ix%i__index", f->codepage, out_width, out_height);
+			out_number_table(&HeaderOut, count > 256 ? "uint16_t" : "uint8_t", name, &index[n], f->size / stride);
+			n += f->size / stride;
+		}
+
+		printf("%ix%i\t%i unique glyphs shared by %i code pages (%i -> %i bytes)\n", out_width, out_height, count, fonts,
+			total * stride, count * stride + total * (count > 256 ? 2 : 1));
+	}
+	printf("\n");
+
+	free(slots);
+	free(index);
+	free(points);
+	free(codes);
+	free(pool.buf);
+}
+
+struct
+{
+	char **name;
+	int count;
+	int size;
+} InputList;
+
+void add_input(const char *name)
+{
+	if (InputList.count == InputList.size)
+	{
+		int size = InputList.size ? InputList.size * 2 : 16;
+		char **list = (char **)realloc(InputList.name, sizeof(char *) * size);
+		if (list == NULL)
+		{
+			printf("Error: Out of memory\n");
+			exit(1);
+		}
+		InputList.name = list;
+		InputList.size = size;
+	}
+
+	InputList.name[InputList.count] = (char *)malloc(strlen(name) + 1);
+	if (InputList.name[InputList.count] == NULL)
+	{
+		printf("Error: Out of memory\n");
+		exit(1);
+	}
+	strcpy(InputList.name[InputList.count++], name);
+}
+
+int compare_names(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+int has_cpi_extension(const char *name)
+{
+	const char *ext = strrchr(name, '.');
+	return ext != NULL && (strcmp(ext, ".cpi") == 0 || strcmp(ext, ".CPI") == 0 || strcmp(ext, ".cpx") == 0 || strcmp(ext, ".CPX") == 0);
+}
+
+// Add every CPI and CPX file below dir, in sorted order so batch output is deterministic
+void add_input_dir(const char *dir)
+{
+	char path[PATH_SIZE];
+	int first = InputList.count;
+	int subdirs = 0;
+	char **dirs = NULL;
+
+#ifdef _WIN32
+	WIN32_FIND_DATAA fd;
+	path_printf(path, "%s\\*", dir);
+	HANDLE find = FindFirstFileA(path, &fd);
+	if (find == INVALID_HANDLE_VALUE)
+		return;
+	do
+	{
+		const char *name = fd.cFileName;
+		int is_dir = (fd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0;
+		if (is_dir && (fd.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT))
+			continue;
+#else
+	DIR *d = opendir(dir);
+	if (d == NULL)
+		return;
+	struct dirent *de;
+	while ((de = readdir(d)) != NULL)
+	{
+		const char *name = de->d_name;
+		struct stat st;
+		path_printf(path, "%s/%s", dir, name);
+		if (lstat(path, &st) != 0)
+			continue;
+		int is_dir = S_ISDIR(st.st_mode);
+
+		// Links to files are followed, links to directories are not, as they can lead back up
+		// the tree and recurse forever
+		if (S_ISLNK(st.st_mode) && (stat(path, &st) != 0 || S_ISDIR(st.st_mode)))
+			continue;
+#endif
+		if (name[0] == '.')
+			continue;
+		path_printf(path, "%s/%s", dir, name);
+		if (is_dir)
+		{
+			char **grown = (char **)realloc(dirs, sizeof(char *) * (subdirs + 1));
+			char *copy = (char *)malloc(strlen(path) + 1);
+			if (grown == NULL || copy == NULL)
+			{
+				printf("Error: Out of memory\n");
+				exit(1);
+			}
+			dirs = grown;
+			strcpy(copy, path);
+			dirs[subdirs++] = copy;
+		}
+		else if (has_cpi_extension(name))
+			add_input(path);
+#ifdef _WIN32
+	} while (FindNextFileA(find, &fd));
+	FindClose(find);
+#else
+	}
+	closedir(d);
+#endif
+
+	qsort(&InputList.name[first], InputList.count - first, sizeof(char *), compare_names);
+	if (subdirs)
+	{
+		qsort(dirs, subdirs, sizeof(char *), compare_names);
+		for (int i = 0; i < subdirs; ++i)
+		{
+			add_input_dir(dirs[i]);
+			free(dirs[i]);
+		}
+	}
+	free(dirs);
+}
+
+// Add every file named in a list file, one per line
+void add_input_list(const char *listfile)
+{
+	char line[PATH_SIZE];
+	FILE *fp = fopen(listfile, "r");
+	if (fp == NULL)
+	{
+		printf("Error: Could not open list file %s\n", listfile);
+		exit(1);
+	}
+
+	while (fgets(line, sizeof(line), fp) != NULL)
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == 0 || line[0] == '#')
+			continue;
+		add_input(line);
+	}
+	fclose(fp);
+}
+
+int is_directory(const char *name)
+{
+#ifdef _WIN32
+	DWORD attr = GetFileAttributesA(name);
+	return attr != INVALID_FILE_ATTRIBUTES && (attr & FILE_ATTRIBUTE_DIRECTORY);
+#else
+	struct stat st;
+	return stat(name, &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+// Derive an output name stem from an input path, eg. test/DOS/EGA.CPI becomes test_DOS_EGA
+void batch_stem(char *stem, const char *infile)
+{
+	const char *ext = strrchr(infile, '.');
+	const char *p = infile;
+	char *s = stem;
+
+	if (strcmp(infile, "-") == 0)
+	{
+		strcpy(stem, "stdin");
+		return;
+	}
+
+	if (ext != NULL && (strchr(ext, '/') != NULL || strchr(ext, '\\') != NULL))
+		ext = NULL;
+
+	while (*p && p != ext)
+	{
+		if (*p == '.' && (p == infile || p[-1] == '/' || p[-1] == '\\'))
+		{
+			// Drop . and .. path components
+			while (*p == '.')
+				++p;
+			continue;
+		}
+		if (*p == '/' || *p == '\\' || *p == ':')
+		{
+			if (s != stem && s[-1] != '_')
+				*s++ = '_';
+		}
+		else if ((*p >= 'a' && *p <= 'z') || (*p >= 'A' && *p <= 'Z') || (*p >= '0' && *p <= '9'))
+			*s++ = *p;
+		else
+			*s++ = '_';
+		++p;
+	}
+	*s = 0;
+}
+
+// Walk the code page entry chain, adding every font to FontTable
+void read_code_pages(void)
+{
+	struct cpi_codepage cp;
+	int err;
+
+	if(options.debug)
+		printf("== FontInfoHeader ==\n%i\n\n", CpiFile.num_codepages);
+
+	FileStats.headers++;
+	FileStats.bytes_read += 2;
+	for (err = cpi_first_codepage(&CpiFile, &cp); err == CPI_OK; err = cpi_next_codepage(&CpiFile, &cp))
+	{
+		// The CodePageEntryHeader (28 bytes) and CodePageInfoHeader (6 bytes) are counted against
+		// the first font of the code page, or the file if it has none
+		struct Counters cp_stats = { 0 };
+		cp_stats.headers = cp.device_type == CPI_DEVICE_PRINTER ? 1 : 2;
+		cp_stats.bytes_read = cp.device_type == CPI_DEVICE_PRINTER ? 28 : 34;
+
+		if (cp.device_type == CPI_DEVICE_PRINTER)
+		{
+			if (options.format == FORMAT_TEXT)
+				printf("Printer font, skipping...\n\n");
+			add_counters(&FileStats, &cp_stats);
+			continue;
+		}
+
+		// Other code pages are only recorded when they are needed for the index file
+		int selected = !options.codepage || options.codepage == cp.codepage;
+		if (!selected && !options.sidecar)
+		{
+			add_counters(&FileStats, &cp_stats);
+			continue;
+		}
+
+		if(options.debug && selected)
+			printf("== CodePageEntryHeader ==\n0x%X\n%i\n%.*s\n%i\n\n", cp.cpeh_size, cp.device_type, 8, cp.device_name, cp.codepage);
+		else if (options.format == FORMAT_TEXT && selected)
+			printf("Code Page: %i\n", cp.codepage);
+
+		if(options.debug && selected)
+			printf("== CodePageInfoHeader ==\n%i\n%i\n0x%X\n\n", cp.version, cp.num_fonts, cp.size);
+
+		for (int n = 0; n < cp.num_fonts; ++n)
+		{
+			struct FontEntry *entry = add_font();
+			entry->cp_index = cp.index;
+			entry->selected = selected;
+			entry->codepage = cp.codepage;
+			entry->device_type = cp.device_type;
+			memcpy(entry->device_name, cp.device_name, 8);
+			double start = stats_clock();
+			err = cpi_font(&CpiFile, &cp, n, 0, &entry->font);
+			if (err != CPI_OK)
+				break;
+
+			// cpi_font reads the ScreenFontHeaders from the first, skipping any bitmaps between them
+			entry->stats.parse = stats_clock() - start;
+			entry->stats.headers = n + 1;
+			entry->stats.bytes_read = 6 * (n + 1);
+			if (n == 0)
+				add_counters(&entry->stats, &cp_stats);
+
+			if(options.debug && selected)
+				printf("== ScreenFontHeader ==\n%i\n%i\n%i\n", entry->font.height, entry->font.width, entry->font.num_chars);
+			else if (options.format == FORMAT_TEXT && selected)
+				printf("%ix%i\t%i characters\n", entry->font.width, entry->font.height, entry->font.num_chars);
+
+			if(options.debug && selected && !entry->font.index_offset)
+				printf("Bitmap length: 0x%lX\n", (long)entry->font.num_chars * entry->font.stride);
+		}
+		if (err != CPI_OK)
+			break;
+		if (options.format == FORMAT_TEXT && selected)
+			printf("\n");
+	}
+
+	if (err != CPI_END)
+	{
+		printf("Error: %s\n", cpi_strerror(err));
+		exit(1);
+	}
+}
+
+// Take bounds checked views of a font's bitmap, or of its DR-DOS index table and the part
+// of the shared glyph pool that table refers to
+void check_font(struct FontEntry *entry)
+{
+	double start = stats_clock();
+	int err = cpi_font_view(&CpiFile, &entry->font);
+	if (err != CPI_OK)
+	{
+		printf("Error: %s\n", cpi_strerror(err));
+		exit(1);
+	}
+	// Ranges are cut off at the end of the font, as they always have been
+	static int warned;
+	if (max_selected_char() >= entry->font.num_chars && !warned)
+	{
+		printf("Warning: Character range exceeds the %i characters in the font, extracting up to %i\n", entry->font.num_chars, entry->font.num_chars - 1);
+		warned = 1;
+	}
+	if (selected_chars(entry) == 0)
+	{
+		printf("Error: No characters selected in the %i characters of the font\n", entry->font.num_chars);
+		exit(1);
+	}
+	entry->glyph_size = glyph_size(&entry->font);
+	if (entry->font.index_offset)
+		entry->stats.bytes_read += entry->font.num_chars * 2;
+	entry->stats.parse += stats_clock() - start;
+}
+
+// Drop fonts of code pages not picked with -c and check the rest. Info only runs never
+// touch the bitmaps.
+void select_fonts(void)
+{
+	int count = 0;
+
+	for (int i = 0; i < FontTable.count; ++i)
+	{
+		if (!FontTable.entry[i].selected)
+		{
+			add_counters(&FileStats, &FontTable.entry[i].stats);
+			continue;
+		}
+		if (i != count)
+		{
+			// Swap rather than copy so each entry keeps its own output buffer
+			struct FontEntry tmp = FontTable.entry[count];
+			FontTable.entry[count] = FontTable.entry[i];
+			FontTable.entry[i] = tmp;
+		}
+		if (!options.info)
+			check_font(&FontTable.entry[count]);
+		++count;
+	}
+	FontTable.count = count;
+}
+
+#define INDEX_VERSION 1
+#define INDEX_HEADER_SIZE 32
+#define INDEX_ENTRY_SIZE 28
+
+long long file_mtime(const char *name)
+{
+	struct stat st;
+	Counting->syscalls++;
+	return stat(name, &st) == 0 ? (long long)st.st_mtime : -1;
+}
+
+// The index file sits next to the input, eg. EGA.CPI.idx
+void index_name(char *name, const char *infile)
+{
+	path_printf(name, "%s.idx", infile);
+}
+
+// Write every font of the input with its bitmap offsets, so later runs can skip the entry chain.
+// The index is only a cache, so failing to write it is not an error. Like any other output it
+// is replaced whole, so other runs never read a partly written index.
+void write_index(const char *infile)
+{
+	char name[PATH_SIZE];
+	struct OutputBuffer ob = { 0 };
+
+	out_write(&ob, "CPIX", 4);
+	out_le(&ob, INDEX_VERSION, 2);
+	out_le(&ob, 0, 2);
+	out_le(&ob, CpiFile.size, 4);
+	out_le(&ob, file_mtime(infile), 8);
+	out_le(&ob, CpiFile.id0, 1);
+	out_write(&ob, CpiFile.id, 7);
+	out_le(&ob, FontTable.count, 4);
+	for (int i = 0; i < FontTable.count; ++i)
+	{
+		const struct FontEntry *entry = &FontTable.entry[i];
+		out_le(&ob, entry->cp_index, 2);
+		out_le(&ob, entry->codepage, 2);
+		out_le(&ob, entry->device_type, 2);
+		out_le(&ob, entry->font.width, 1);
+		out_le(&ob, entry->font.height, 1);
+		out_le(&ob, entry->font.num_chars, 2);
+		out_le(&ob, 0, 2);
+		out_le(&ob, entry->font.bitmap_offset, 4);
+		out_le(&ob, entry->font.index_offset, 4);
+		out_write(&ob, entry->device_name, 8);
+	}
+
+	index_name(name, infile);
+	update_file(name, ob.buf, ob.len);
+	free(ob.buf);
+}
+
+unsigned long index_le(const unsigned char *p, int bytes)
+{
+	unsigned long value = 0;
+	for (int i = bytes - 1; i >= 0; --i)
+		value = (value << 8) | p[i];
+	return value;
+}
+
+// Fill FontTable from the index file, if there is one that matches the input's size and
+// modification time
+int read_index(const char *infile)
+{
+	char name[PATH_SIZE];
+	unsigned char header[INDEX_HEADER_SIZE];
+	unsigned char record[INDEX_ENTRY_SIZE];
+
+	index_name(name, infile);
+	int fd = open(name, O_RDONLY | O_BINARY);
+	FileStats.syscalls++;
+	if (fd < 0)
+		return 0;
+
+	long long mtime = file_mtime(infile);
+	int ok = mtime >= 0 && read_all(fd, header, sizeof(header));
+	if (!ok || memcmp(header, "CPIX", 4) != 0 ||
+		index_le(header + 4, 2) != INDEX_VERSION || (long)index_le(header + 8, 4) != CpiFile.size ||
+		(long long)index_le(header + 12, 4) + ((long long)index_le(header + 16, 4) << 32) != mtime ||
+		header[20] != CpiFile.id0 || memcmp(header + 21, CpiFile.id, 7) != 0)
+	{
+		close(fd);
+		FileStats.syscalls++;
+		return 0;
+	}
+
+	long count = (long)index_le(header + 28, 4);
+	for (long i = 0; i < count; ++i)
+	{
+		if (!read_all(fd, record, sizeof(record)))
+		{
+			FontTable.count = 0;
+			close(fd);
+			FileStats.syscalls++;
+			return 0;
+		}
+
+		struct FontEntry *entry = add_font();
+		entry->cp_index = (int)index_le(record, 2);
+		entry->codepage = (int)index_le(record + 2, 2);
+		entry->device_type = (int)index_le(record + 4, 2);
+		entry->font.width = record[6];
+		entry->font.height = record[7];
+		entry->font.num_chars = (int)index_le(record + 8, 2);
+		entry->font.stride = entry->font.height * ((entry->font.width + 7) / 8);
+		entry->font.bitmap_offset = (long)index_le(record + 12, 4);
+		entry->font.index_offset = (long)index_le(record + 16, 4);
+		memcpy(entry->device_name, record + 20, 8);
+		entry->selected = !options.codepage || options.codepage == entry->codepage;
+	}
+	close(fd);
+	FileStats.syscalls++;
+
+	// Same listing as walking the entry chain
+	for (int i = 0; i < FontTable.count && options.format == FORMAT_TEXT; ++i)
+	{
+		const struct FontEntry *entry = &FontTable.entry[i];
+		if (!entry->selected)
+			continue;
+		if (i == 0 || entry->cp_index != FontTable.entry[i - 1].cp_index || !FontTable.entry[i - 1].selected)
+			printf("Code Page: %i\n", entry->codepage);
+		printf("%ix%i\t%i characters\n", entry->font.width, entry->font.height, entry->font.num_chars);
+		if (i == FontTable.count - 1 || entry->cp_index != FontTable.entry[i + 1].cp_index)
+			printf("\n");
+	}
+
+	return 1;
+}
+
+void print_json_string(const char *str, int len)
+{
+	putchar('"');
+	for (int i = 0; i < len && str[i]; ++i)
+	{
+		unsigned char c = (unsigned char)str[i];
+		if (c == '"' || c == '\\')
+			printf("\\%c", c);
+		else if (c < 0x20)
+			printf("\\u%04X", c);
+		else
+			putchar(c);
+	}
+	putchar('"');
+}
+
+// Print a CSV field, quoted if it holds a comma, quote or line break
+void print_csv_string(const char *str, int len)
+{
+	int quote = 0;
+	for (int i = 0; i < len && str[i]; ++i)
+		quote |= str[i] == ',' || str[i] == '"' || str[i] == '\n' || str[i] == '\r';
+	if (!quote)
+	{
+		printf("%.*s", len, str);
+		return;
+	}
+
+	putchar('"');
+	for (int i = 0; i < len && str[i]; ++i)
+	{
+		if (str[i] == '"')
+			putchar('"');
+		putchar(str[i]);
+	}
+	putchar('"');
+}
+
+// Bytes of bitmap used by a font. For a DR-DOS font this is the part of the shared glyph pool
+// up to the last glyph its index table refers to, or 0 if the table is outside the file.
+long font_length(const struct FontEntry *entry)
+{
+	if (!entry->font.index_offset)
+		return (long)entry->font.num_chars * entry->font.stride;
+	if (entry->font.index_offset + entry->font.num_chars * 2L > CpiFile.size)
+		return 0;
+
+	long glyphs = 0;
+	for (int c = 0; c < entry->font.num_chars; ++c)
+	{
+		long glyph = (long)index_le(CpiFile.data + entry->font.index_offset + c * 2, 2);
+		if (glyph + 1 > glyphs)
+			glyphs = glyph + 1;
+	}
+	return glyphs * entry->font.stride;
+}
+
+// Length of a space padded header field
+int field_length(const char *field, int size)
+{
+	while (size > 0 && (field[size - 1] == ' ' || field[size - 1] == 0))
+		--size;
+	return size;
+}
+
+// Print the font table as one JSON object per input file, or as CSV rows
+void write_info(const char *infile)
+{
+	static int csv_header;
+
+	if (options.format == FORMAT_CSV)
+	{
+		if (!csv_header)
+			printf("file,type,codepage,device_type,device,width,height,chars,offset,length,index_offset\n");
+		csv_header = 1;
+
+		for (int i = 0; i < FontTable.count; ++i)
+		{
+			const struct FontEntry *entry = &FontTable.entry[i];
+			print_csv_string(infile, (int)strlen(infile));
+			printf(",%.*s,%i,%i,", field_length(CpiFile.id, 7), CpiFile.id, entry->codepage, entry->device_type);
+			print_csv_string(entry->device_name, field_length(entry->device_name, 8));
+			printf(",%i,%i,%i,%li,%li,%li\n", entry->font.width, entry->font.height, entry->font.num_chars,
+				entry->font.bitmap_offset, font_length(entry), entry->font.index_offset);
+		}
+		return;
+	}
+
+	printf("{\"file\":");
+	print_json_string(infile, (int)strlen(infile));
+	printf(",\"size\":%li,\"type\":", CpiFile.size);
+	print_json_string(CpiFile.id, field_length(CpiFile.id, 7));
+	printf(",\"codepages\":[");
+	for (int i = 0; i < FontTable.count; ++i)
+	{
+		const struct FontEntry *entry = &FontTable.entry[i];
+		if (i == 0 || entry->cp_index != FontTable.entry[i - 1].cp_index)
+		{
+			printf("%s{\"codepage\":%i,\"device_type\":%i,\"device\":", i ? "]}," : "", entry->codepage, entry->device_type);
+			print_json_string(entry->device_name, field_length(entry->device_name, 8));
+			printf(",\"fonts\":[");
+		}
+		else
+			printf(",");
+		printf("{\"width\":%i,\"height\":%i,\"chars\":%i,\"offset\":%li,\"length\":%li",
+			entry->font.width, entry->font.height, entry->font.num_chars, entry->font.bitmap_offset, font_length(entry));
+		if (entry->font.index_offset)
+			printf(",\"index_offset\":%li", entry->font.index_offset);
+		printf("}");
+	}
+	printf("%s]}\n", FontTable.count ? "]}" : "");
+}
+
+// Add len bytes to a 64-bit FNV-1a hash
+unsigned long long hash_bytes(unsigned long long hash, const void *data, size_t len)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	for (size_t i = 0; i < len; ++i)
+		hash = (hash ^ p[i]) * 1099511628211ULL; // FNV-1a
+	return hash;
+}
+
+// Add an integer to a hash as 8 little endian bytes, whatever its size and byte order here
+unsigned long long hash_int(unsigned long long hash, long long value)
+{
+	unsigned char bytes[8];
+	for (int i = 0; i < 8; ++i)
+		bytes[i] = (unsigned char)((unsigned long long)value >> (8 * i));
+	return hash_bytes(hash, bytes, 8);
+}
+
+// Name of the cache file for the output of the open input to outfile. The key covers the tool
+// version, every option that changes the output, the output names and the input itself.
+void cache_name(char *name, const char *outfile)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+
+	// Only the options that change the output, one at a time, as the options struct holds
+	// padding and pointers that differ between runs. --rotate and --flip cover the transpose
+	// and orient derived from them.
+	const long long settings[] =
+	{
+		options.stream, options.lsb_first, options.big_endian, options.output, options.layout,
+		options.word, options.bpp, options.fg, options.bg, options.pack, options.compress,
+		options.rotate, options.flip, options.elf_machine, options.codepage
+	};
+	hash = hash_bytes(hash, CPI2HEX_VERSION, sizeof(CPI2HEX_VERSION));
+	for (int i = 0; i < (int)(sizeof(settings) / sizeof(settings[0])); ++i)
+		hash = hash_int(hash, settings[i]);
+	hash = hash_int(hash, Selection.used);
+	hash = hash_int(hash, Selection.open_from);
+	hash = hash_int(hash, Selection.num_runs);
+	for (int i = 0; i < Selection.num_runs; ++i)
+	{
+		hash = hash_int(hash, Selection.run[i][0]);
+		hash = hash_int(hash, Selection.run[i][1]);
+	}
+	hash = hash_bytes(hash, outfile, strlen(outfile) + 1);
+	hash = hash_bytes(hash, OutputPrefix, strlen(OutputPrefix) + 1);
+	hash = hash_bytes(hash, CpiFile.data, CpiFile.size);
+
+	const char *sep = options.cache[0] && options.cache[strlen(options.cache) - 1] != '/' ? "/" : "";
+	path_printf(name, "%s%s%016llx.cache", options.cache, sep, hash);
+}
+
+// Write the outputs recorded in a cache file again, returning 0 if there is no usable entry
+int replay_cache(const char *name)
+{
+	long long file = file_size(name);
+	if (file < 0)
+		return 0;
+	size_t size = (size_t)file;
+	unsigned char *data = read_existing(name, size);
+	if (data == NULL || size < 8 || memcmp(data, CACHE_MAGIC, 8) != 0)
+	{
+		free(data);
+		return 0;
+	}
+
+	// Check every record before writing anything
+	for (int write = 0; write < 2; ++write)
+	{
+		size_t pos = 8;
+		while (pos < size)
+		{
+			char file[PATH_SIZE];
+			size_t name_len = size - pos >= 4 ? (size_t)index_le(data + pos, 4) : PATH_SIZE;
+			if (name_len >= PATH_SIZE || size - pos < 12 + name_len)
+			{
+				free(data);
+				return 0;
+			}
+			memcpy(file, data + pos + 4, name_len);
+			file[name_len] = 0;
+			pos += 4 + name_len;
+			unsigned long long len = index_le(data + pos, 4) | (unsigned long long)index_le(data + pos + 4, 4) << 32;
+			pos += 8;
+			if (len > size - pos)
+			{
+				free(data);
+				return 0;
+			}
+			if (write)
+				commit_output(file, data + pos, (size_t)len);
+			pos += (size_t)len;
+		}
+	}
+	free(data);
+	return 1;
+}
+
+void write_depfile(const char *name)
+{
+	write_output(name, Deps.rules.buf, Deps.rules.len);
+	Deps.rules.len = 0;
+}
+
+void save_cache(const char *name)
+{
+	struct OutputBuffer ob = { 0 };
+
+#ifdef _WIN32
+	_mkdir(options.cache);
+#else
+	mkdir(options.cache, 0755);
+#endif
+	out_write(&ob, CACHE_MAGIC, 8);
+	out_write(&ob, Cache.files.buf, Cache.files.len);
+	write_output(name, ob.buf, ob.len);
+	free(ob.buf);
+}
+
+// Close the -MD rule of an input. Without -MF the rules go straight to a depfile named after
+// the -o file, otherwise they are collected for write_depfile.
+void add_dep_rule(const char *infile, const char *outfile)
+{
+	if (!Deps.enabled)
+		return;
+
+	if (Deps.targets.len)
+	{
+		out_write(&Deps.rules, Deps.targets.buf, Deps.targets.len);
+		out_str(&Deps.rules, ":");
+		if (strcmp(infile, "-") != 0)
+		{
+			out_str(&Deps.rules, " ");
+			dep_path(&Deps.rules, infile);
+		}
+		out_str(&Deps.rules, "\n");
+	}
+	Deps.targets.len = 0;
 
-struct
-{
-	unsigned char  id0;
-	char  id[7];
-	char  reserved[8];
-	short pnum;
-	char  ptyp;
-	long  fih_offset;
-} FontFileHeader;
+	if (Deps.file == NULL)
+	{
+		char depfile[PATH_SIZE];
+		replace_extension(depfile, outfile, ".d");
+		write_depfile(depfile);
+	}
+}
 
-struct
+void print_counters(const struct Counters *c)
 {
-	char num_fonts_per_codepage;
-	char *font_cellsize;
-	long *dfd_offset;
-} DRDOSExtendedFontFileHeader;
+	if (options.stats == STATS_JSON)
+		printf("\"parse_seconds\":%.6f,\"format_seconds\":%.6f,\"write_seconds\":%.6f,\"headers\":%lld,\"bytes_read\":%lld,\"bytes_written\":%lld,\"seeks\":%lld,\"syscalls\":%lld,\"glyphs\":%lld}",
+			c->parse, c->format, c->write, c->headers, c->bytes_read, c->bytes_written, c->seeks, c->syscalls, c->glyphs);
+	else
+		printf("\t%.3f\t%.3f\t%.3f\t%lld\t%lld\t%lld\t%lld\t%lld\t%lld\n",
+			c->parse * 1000, c->format * 1000, c->write * 1000, c->headers, c->bytes_read, c->bytes_written, c->seeks, c->syscalls, c->glyphs);
+}
 
-struct
+// Report --stats for the input just processed, with a row per code page and the total, which
+// is also added to the run total. The total parse time is the wall time of the whole header
+// walk rather than the sum of the fonts.
+void print_stats(const char *infile)
 {
-	short num_codepages;
-} FontInfoHeader;
+	struct Counters total = FileStats;
+	for (int i = 0; i < FontTable.count; ++i)
+		add_counters(&total, &FontTable.entry[i].stats);
+	total.parse = FileStats.parse;
+	add_counters(&RunStats, &total);
 
-struct
-{
-	short cpeh_size;
-	long next_cpeh_offset;
-	short device_type;
-	char device_name[8];
-	short codepage;
-	char reserved[6];
-	long cpih_offset;
-} CodePageEntryHeader;
+	if (options.stats == STATS_JSON)
+	{
+		printf("{\"file\":");
+		print_json_string(infile, (int)strlen(infile));
+		printf(",\"codepages\":[");
+	}
+	else
+		printf("== Stats: %s ==\nCode page\tParse ms\tFormat ms\tWrite ms\tHeaders\tRead\tWritten\tSeeks\tSyscalls\tGlyphs\n", infile);
 
-struct
-{
-	short version;
-	short num_fonts;
-	short size;
-} CodePageInfoHeader;
+	for (int i = 0; i < FontTable.count; )
+	{
+		const struct FontEntry *entry = &FontTable.entry[i];
+		struct Counters cp = { 0 };
+		int fonts = 0;
+		for (; i < FontTable.count && FontTable.entry[i].cp_index == entry->cp_index; ++i, ++fonts)
+			add_counters(&cp, &FontTable.entry[i].stats);
 
-struct
+		if (options.stats == STATS_JSON)
+			printf("%s{\"codepage\":%i,\"fonts\":%i,", entry == FontTable.entry ? "" : ",", entry->codepage, fonts);
+		else
+			printf("%i", entry->codepage);
+		print_counters(&cp);
+	}
+
+	if (options.stats == STATS_JSON)
+	{
+		printf("],\"total\":{");
+		print_counters(&total);
+		printf("}\n");
+	}
+	else
+	{
+		printf("Total");
+		print_counters(&total);
+		printf("\n");
+	}
+}
+
+// Parse one CPI file and extract its fonts into outfile (or per font binary files)
+void process_file(const char *infile, const char *outfile)
 {
-	char height;
-	char width;
-	char yaspect;
-	char xaspect;
-	short num_chars;
-} ScreenFontHeader;
+	char cache_file[PATH_SIZE];
 
-struct
+	memset(&FileStats, 0, sizeof(FileStats));
+	FontTable.count = 0;
+	double start = stats_clock();
+	open_input(infile);
+
+	if (options.cache && !options.info && !options.debug)
+	{
+		cache_name(cache_file, outfile);
+		FileStats.bytes_read += CpiFile.size;
+		if (replay_cache(cache_file))
+		{
+			if (options.format == FORMAT_TEXT)
+				printf("Output of %s is unchanged, taken from %s\n\n", infile, cache_file);
+			add_dep_rule(infile, outfile);
+			close_input();
+			if (options.stats)
+				print_stats(infile);
+			return;
+		}
+		Cache.recording = 1;
+		Cache.files.len = 0;
+	}
+
+	if(options.debug)
+		printf("== FontFileHeader ==\n0x%X\n%.*s\n%i\n%i\n0x%lX\n\n", CpiFile.id0, 7, CpiFile.id, CpiFile.pnum, CpiFile.ptyp, CpiFile.fih_offset);
+
+	if (CpiFile.id0 == 0x7F && options.debug)
+	{
+		printf("== DRDOSExtendedFontFileHeader ==\n");
+		printf("Fonts: %i\n", CpiFile.drdos_fonts);
+		for (int i = 0; i < CpiFile.drdos_fonts; ++i)
+		{
+			int cellsize;
+			long offset;
+			cpi_drdos_font(&CpiFile, i, &cellsize, &offset);
+			printf("Size: %i\nOffset: 0x%lX\n", cellsize, offset);
+		}
+		printf("\n");
+	}
+
+	// There is nowhere to keep an index for stdin
+	int sidecar = options.sidecar && strcmp(infile, "-") != 0;
+
+	if (!sidecar || options.debug || !read_index(infile))
+	{
+		read_code_pages();
+		if (sidecar)
+			write_index(infile);
+	}
+	select_fonts();
+	FileStats.parse = stats_clock() - start;
+
+	if (options.info)
+	{
+		if (options.format != FORMAT_TEXT)
+			write_info(infile);
+		close_input();
+		if (options.stats)
+			print_stats(infile);
+		return;
+	}
+
+	run_jobs(outfile);
+
+	// Output put together once every font is extracted counts as formatting too
+	start = stats_clock();
+	double written = FileStats.write;
+	if (options.output == OUTPUT_ELF)
+		write_elf(outfile);
+	else if (options.output == OUTPUT_ASM)
+		write_asm(outfile);
+	else if (options.output == OUTPUT_EMBED)
+		write_embed(outfile);
+	else if (options.output == OUTPUT_SHARED || options.output == OUTPUT_UNICODE)
+		write_shared(outfile);
+	else if (options.compress)
+		print_compression();
+
+	close_header(outfile);
+	if (Cache.recording)
+	{
+		Cache.recording = 0;
+		save_cache(cache_file);
+	}
+	FileStats.format += stats_clock() - start - (FileStats.write - written);
+	add_dep_rule(infile, outfile);
+	close_input();
+	if (options.stats)
+		print_stats(infile);
+}
+
+// Value of a --name=value option, or NULL if arg is not that option
+const char *long_option(const char *arg, const char *name)
 {
-	short FontIndex[256];
-} CharacterIndexTable;
+	size_t len = strlen(name);
+	if (strncmp(arg + 2, name, len) == 0 && arg[2 + len] == '=')
+		return arg + 3 + len;
+	return NULL;
+}
 
-struct
+// Pixel value given to --fg or --bg, in decimal, hex or octal. Whether it fits --bpp is
+// checked once every option is read.
+int pixel_option(const char *name, const char *value)
 {
-	unsigned int info : 1;
-	unsigned int debug : 1;
-	unsigned int binary : 1;
-	short codepage;
-	int range[20][2];
-	int num_ranges;
-} options;
+	char *end;
+	long pixel = strtol(value, &end, 0);
+	if (*end || end == value || pixel < 0 || pixel > 255)
+	{
+		printf("Error: Unsupported --%s pixel value '%s'\n", name, value);
+		exit(1);
+	}
+	return (int)pixel;
+}
 
 int main(int argc, char *argv[])
 {
-	FILE *fp;
-	char infile[256];
-	char outfile[256] = "font.h";
+	char outfile[PATH_SIZE] = "font.h";
+	int outdir = 0;
+	int batch = 0;
 
 	if (argc < 2)
 	{
 		printf(
-			"Extracts code page fonts from a CPI file into a hex byte array.\n\n"
-			"cpi2hex <file>\n\n"
+			"Extracts code page fonts from a CPI or CPX file into a hex byte array.\n\n"
+			"cpi2hex <file|directory|@listfile|-> [...]\n\n"
 			"Options:\n"
 			"\t-i\t\tList information only, don't output to file\n"
-			"\t-o <name>\tSpecify an output file name (font.h by default)\n"
-			"\t-b\t\tOutput data as a raw binary files (-o option will be ignored)\n"
+			"\t-f <format>\tList information as json or csv, including the file offset\n"
+			"\t\t\tof every font bitmap\n"
+			"\t-o <name>\tSpecify an output file name (font.h by default), or the output\n"
+			"\t\t\tdirectory when more than one file is given. - writes to stdout\n"
+			"\t-b\t\tOutput data as a raw binary files (-o option will be ignored\n"
+			"\t\t\tunless it is -)\n"
+			"\t-l <arch>\tOutput a linkable ELF object for x86-64 or arm next to a header\n"
+			"\t\t\twith declarations only\n"
+			"\t-a\t\tOutput binary files and an assembler file including them with .incbin\n"
+			"\t-e\t\tOutput binary files and a header including them with #embed\n"
+			"\t-s\t\tOutput one pool of unique glyphs per font size shared by all\n"
+			"\t\t\tcode pages, with an index table per code page\n"
+			"\t-u\t\tOutput one set of unique glyphs per font size keyed by Unicode,\n"
+			"\t\t\tmerging all code pages, with a sorted table of code points\n"
 			"\t-c <number>\tSpecify the code page to extract\n"
 			"\t-r <range>\tSpecify a range of characters to extract. Multiple\n"
 			"\t\t\tranges can be specified seprated by commas eg: -r 32-167,57,2-4\n"
+			"\t\t\tRanges starting with ^ are left out and ranges ending with -\n"
+			"\t\t\trun to the end of the font eg: -r ^0-31 or -r 128-\n"
 			"\t-d\t\tPrint debug information about file headers\n"
+			"\t-MD\t\tWrite a make depfile naming every output file as a target of\n"
+			"\t\t\tthe input, named after the -o file with a .d extension\n"
+			"\t-MF <name>\tWrite the depfile rules of all inputs to this file\n"
+			"\t-x\t\tKeep an index of font offsets next to each input (<file>.idx)\n"
+			"\t\t\tand use it to skip parsing the code page headers\n"
+			"\t-j <number>\tExtract code pages on this many worker threads\n"
+			"\t--layout=<layout>\n"
+			"\t\t\tOutput glyphs as rows (the default), or as vertical bytes\n"
+			"\t\t\twith the top pixel in bit 0 ordered by columns or by pages\n"
+			"\t\t\tof 8 rows, as taken by SSD1306 style displays\n"
+			"\t--rotate=<degrees>\n"
+			"\t\t\tRotate glyphs clockwise by 90, 180 or 270 degrees\n"
+			"\t--flip=<h|v|hv>\tMirror glyphs left to right and/or upside down,\n"
+			"\t\t\tafter rotating\n"
+			"\t--bits=<msb|lsb>\tPut the leftmost pixel of a row in the top bit (the\n"
+			"\t\t\tdefault) or bottom bit of each byte or word\n"
+			"\t--word=<bits>\tPack rows into 16 or 32 bit words, little endian or\n"
+			"\t\t\tbig endian with a be suffix eg: --word=16be\n"
+			"\t--bpp=<bits>\tExpand glyphs to 2, 4 or 8 bits per pixel\n"
+			"\t--fg=<value>\tPixel value of set bits (all ones by default)\n"
+			"\t--bg=<value>\tPixel value of clear bits (0 by default)\n"
+			"\t--compress=<rle|dict>\n"
+			"\t\t\tWrite run length coded glyphs, or a table of unique rows\n"
+			"\t\t\tindexed per glyph, with decoders in the header\n"
+			"\t--cache=<dir>\tKeep the output of each run in dir, keyed by a hash of\n"
+			"\t\t\tthe input and options, and reuse it when nothing changed\n"
+			"\t--stats[=<text|json>]\n"
+			"\t\t\tReport the time spent parsing, formatting and writing, and\n"
+			"\t\t\tcounts of the work done, per code page and in total\n"
 		);
 		exit(0);
 	}
 
-	options.num_ranges = 0;
+	init_hex_table();
+	init_bit_reverse();
+#ifdef _WIN32
+	InitializeCriticalSection(&JobLock);
+#endif
+
+	options.bpp = 1;
+	options.fg = -1;
+	Selection.open_from = MAX_CHARS;
 	for (int n = 1; n < argc; n++)
 	{
-		switch ((int)argv[n][0])
+		int is_option = (argv[n][0] == '-' && argv[n][1] != 0) || (argv[n][0] == '/' && argv[n][1] != 0 && argv[n][2] == 0);
+		const char *value;
+
+		switch (is_option ? '-' : (argv[n][0] == '@' ? '@' : 0))
 		{
 		case '-':
-		case '/':
 			switch ((char)argv[n][1])
 			{
 			case 'o':
@@ -118,10 +3015,70 @@ int main(int argc, char *argv[])
 					printf("Error: No output file specified after -o\n");
 					exit(1);
 				}
-				strcpy(outfile, argv[++n]);
+				path_printf(outfile, "%s", argv[++n]);
+				outdir = 1;
 				break;
 			case 'b':
-				options.binary = 1;
+				options.output = OUTPUT_BINARY;
+				break;
+			case 'l':
+				if (n + 1 == argc)
+				{
+					printf("Error: No architecture specified after -l\n");
+					exit(1);
+				}
+				++n;
+				if (strcmp(argv[n], "x86-64") == 0 || strcmp(argv[n], "x86_64") == 0 || strcmp(argv[n], "amd64") == 0)
+					options.elf_machine = EM_X86_64;
+				else if (strcmp(argv[n], "arm") == 0 || strcmp(argv[n], "thumb") == 0)
+					options.elf_machine = EM_ARM;
+				else
+				{
+					printf("Error: Unsupported architecture '%s' after -l\n", argv[n]);
+					exit(1);
+				}
+				options.output = OUTPUT_ELF;
+				break;
+			case 'a':
+				options.output = OUTPUT_ASM;
+				break;
+			case 'e':
+				options.output = OUTPUT_EMBED;
+				break;
+			case 's':
+				options.output = OUTPUT_SHARED;
+				break;
+			case 'u':
+				options.output = OUTPUT_UNICODE;
+				break;
+			case 'f':
+				if (n + 1 == argc)
+				{
+					printf("Error: No format specified after -f\n");
+					exit(1);
+				}
+				++n;
+				if (strcmp(argv[n], "json") == 0)
+					options.format = FORMAT_JSON;
+				else if (strcmp(argv[n], "csv") == 0)
+					options.format = FORMAT_CSV;
+				else
+				{
+					printf("Error: Unsupported format '%s' after -f\n", argv[n]);
+					exit(1);
+				}
+				options.info = 1;
+				break;
+			case 'x':
+				options.sidecar = 1;
+				break;
+			case 'j':
+				if (n + 1 == argc)
+				{
+					printf("Error: No job count specified after -j\n");
+					exit(1);
+				}
+				options.jobs = atoi(argv[++n]);
 				break;
 			case 'i':
 				options.info = 1;
@@ -140,335 +3097,273 @@ int main(int argc, char *argv[])
 					printf("Error: No range specified after -r\n");
 					exit(1);
 				}
-				
-				char *pair = strtok(argv[++n], ",");
-				while (pair != NULL)
+				add_selection(argv[++n]);
+				break;
+			case 'd':
+				options.debug = 1;
+				break;
+			case 'M':
+				if (strcmp(argv[n], "-MD") == 0)
+					Deps.enabled = 1;
+				else if (strcmp(argv[n], "-MF") == 0)
+				{
+					if (n + 1 == argc)
+					{
+						printf("Error: No depfile specified after -MF\n");
+						exit(1);
+					}
+					Deps.enabled = 1;
+					Deps.file = argv[++n];
+				}
+				else
+				{
+					printf("Error: Unknown option %s\n", argv[n]);
+					exit(1);
+				}
+				break;
+			case '-':
+				if ((value = long_option(argv[n], "rotate")) != NULL)
 				{
-					int start, end;
-					int num = sscanf(pair, "%d-%d", &start, &end);
-					if (num <= 0)
+					char *end;
+					options.rotate = (int)strtol(value, &end, 10);
+					if (*end || end == value || options.rotate % 90 || options.rotate < 0 || options.rotate > 270)
 					{
-						printf("Error: Invalid argument '%s' after -r\n", pair);
+						printf("Error: Unsupported rotation '%s'\n", value);
 						exit(1);
 					}
-					if (num == 1)
-						end = start;
-
-					if (start < 0)
-						start = 0;
-					if (start > 255)
-						start = 255;
-					if (end > 255)
-						end = 255;
-
-					if (end < start)
+				}
+				else if ((value = long_option(argv[n], "flip")) != NULL)
+				{
+					if (strcmp(value, "h") == 0)
+						options.flip = FLIP_H;
+					else if (strcmp(value, "v") == 0)
+						options.flip = FLIP_V;
+					else if (strcmp(value, "hv") == 0)
+						options.flip = FLIP_H | FLIP_V;
+					else
 					{
-						printf("Error: Ending range can not be smaller than starting range\n");
+						printf("Error: Unsupported flip '%s'\n", value);
 						exit(1);
 					}
-
-					options.range[options.num_ranges][0] = start;
-					options.range[options.num_ranges][1] = end;
-
-					options.num_ranges++;
-					pair = strtok(NULL, ",");
 				}
-				break;
-			case 'd':
-				options.debug = 1;
+				else if ((value = long_option(argv[n], "bits")) != NULL)
+				{
+					if (strcmp(value, "msb") == 0)
+						options.lsb_first = 0;
+					else if (strcmp(value, "lsb") == 0)
+						options.lsb_first = 1;
+					else
+					{
+						printf("Error: Unsupported bit order '%s'\n", value);
+						exit(1);
+					}
+				}
+				else if ((value = long_option(argv[n], "word")) != NULL)
+				{
+					char *end;
+					int bits = (int)strtol(value, &end, 10);
+					options.big_endian = strcmp(end, "be") == 0;
+					if ((bits != 8 && bits != 16 && bits != 32) || (*end && strcmp(end, "le") != 0 && strcmp(end, "be") != 0))
+					{
+						printf("Error: Unsupported word size '%s'\n", value);
+						exit(1);
+					}
+					options.word = bits / 8;
+				}
+				else if ((value = long_option(argv[n], "bpp")) != NULL)
+				{
+					options.bpp = atoi(value);
+					if (options.bpp != 1 && options.bpp != 2 && options.bpp != 4 && options.bpp != 8)
+					{
+						printf("Error: Unsupported bits per pixel '%s'\n", value);
+						exit(1);
+					}
+				}
+				else if ((value = long_option(argv[n], "fg")) != NULL)
+					options.fg = pixel_option("fg", value);
+				else if ((value = long_option(argv[n], "bg")) != NULL)
+					options.bg = pixel_option("bg", value);
+				else if ((value = long_option(argv[n], "compress")) != NULL)
+				{
+					if (strcmp(value, "rle") == 0)
+						options.compress = COMPRESS_RLE;
+					else if (strcmp(value, "dict") == 0)
+						options.compress = COMPRESS_DICT;
+					else
+					{
+						printf("Error: Unsupported compression '%s'\n", value);
+						exit(1);
+					}
+				}
+				else if ((value = long_option(argv[n], "cache")) != NULL)
+					options.cache = value;
+				else if (strcmp(argv[n], "--stats") == 0)
+					options.stats = STATS_TEXT;
+				else if ((value = long_option(argv[n], "stats")) != NULL)
+				{
+					if (strcmp(value, "text") == 0)
+						options.stats = STATS_TEXT;
+					else if (strcmp(value, "json") == 0)
+						options.stats = STATS_JSON;
+					else
+					{
+						printf("Error: Unsupported stats format '%s'\n", value);
+						exit(1);
+					}
+				}
+				else if ((value = long_option(argv[n], "layout")) != NULL)
+				{
+					if (strcmp(value, "rows") == 0)
+						options.layout = LAYOUT_ROWS;
+					else if (strcmp(value, "columns") == 0)
+						options.layout = LAYOUT_COLUMNS;
+					else if (strcmp(value, "pages") == 0)
+						options.layout = LAYOUT_PAGES;
+					else
+					{
+						printf("Error: Unsupported layout '%s'\n", value);
+						exit(1);
+					}
+				}
+				else
+				{
+					printf("Error: Unknown option %s\n", argv[n]);
+					exit(1);
+				}
 				break;
 			}
 			break;
+		case '@':
+			add_input_list(argv[n] + 1);
+			batch = 1;
+			break;
 		default:
-			strcpy(infile, argv[n]);
+			if (is_directory(argv[n]))
+			{
+				add_input_dir(argv[n]);
+				batch = 1;
+			}
+			else
+				add_input(argv[n]);
 			break;
 		}
 	}
 
-	fp = fopen(infile, "rb");
-	if(fp == NULL)
+	select_runs();
+
+	// 90 is a transpose then a horizontal flip, 270 a transpose then a vertical flip
+	options.transpose = options.rotate == 90 || options.rotate == 270;
+	options.orient = options.flip;
+	if (options.rotate == 90 || options.rotate == 180)
+		options.orient ^= FLIP_H;
+	if (options.rotate == 180 || options.rotate == 270)
+		options.orient ^= FLIP_V;
+
+	if (options.fg < 0)
+		options.fg = (1 << options.bpp) - 1;
+	if (options.fg >= 1 << options.bpp || options.bg < 0 || options.bg >= 1 << options.bpp)
+	{
+		printf("Error: --fg and --bg must be from 0 to %i with %i bits per pixel\n", (1 << options.bpp) - 1, options.bpp);
+		exit(1);
+	}
+	options.pack = options.lsb_first || options.word > 1 || options.bpp > 1 || options.fg != 1 || options.bg != 0;
+	if (options.pack && options.layout != LAYOUT_ROWS)
 	{
-		printf("Error: Could not open file %s\n", infile);
+		printf("Error: --bpp, --fg, --bg, --bits and --word only apply to --layout=rows\n");
+		exit(1);
+	}
+	init_expand();
+	if (options.compress && options.output != OUTPUT_HEADER)
+	{
+		printf("Error: --compress only applies to header output\n");
+		exit(1);
+	}
+	if (options.word > 1 && options.output == OUTPUT_EMBED)
+	{
+		printf("Error: -e can only embed byte arrays, use -l or -a with --word\n");
 		exit(1);
 	}
 
-	fread(&FontFileHeader.id0, 1, 1, fp);
-	if (FontFileHeader.id0 != 0xFF && FontFileHeader.id0 != 0x7F)
+	if (InputList.count == 0)
 	{
-		printf("Error: Unsupported file type\n");
+		printf("Error: No input files\n");
 		exit(1);
 	}
-	fread(&FontFileHeader.id, 1, 7, fp);
-	fread(&FontFileHeader.reserved, 1, 8, fp);
-	fread(&FontFileHeader.pnum, 2, 1, fp);
-	fread(&FontFileHeader.ptyp, 1, 1, fp);
-	fread(&FontFileHeader.fih_offset, 4, 1, fp);
+	if (InputList.count > 1)
+		batch = 1;
 
-	if(options.debug)
-		printf("== FontFileHeader ==\n0x%X\n%.*s\n%i\n%i\n0x%X\n\n", FontFileHeader.id0, 7, FontFileHeader.id, FontFileHeader.pnum, FontFileHeader.ptyp, FontFileHeader.fih_offset);
-	
-	if (FontFileHeader.id0 == 0x7F)
+	if (strcmp(outfile, "-") == 0 && !options.info)
 	{
-		fread(&DRDOSExtendedFontFileHeader.num_fonts_per_codepage, 1, 1, fp);
-		DRDOSExtendedFontFileHeader.font_cellsize = (char *)malloc(sizeof(char) * DRDOSExtendedFontFileHeader.num_fonts_per_codepage);
-		DRDOSExtendedFontFileHeader.dfd_offset = (long *)malloc(sizeof(long) * DRDOSExtendedFontFileHeader.num_fonts_per_codepage);
-		for (int i = 0; i < DRDOSExtendedFontFileHeader.num_fonts_per_codepage; ++i)
+		if (Deps.enabled && Deps.file == NULL)
 		{
-			fread(&DRDOSExtendedFontFileHeader.font_cellsize[i], 1, 1, fp);
+			printf("Error: -MD can't name a depfile after -o -, use -MF\n");
+			exit(1);
 		}
-		for (int i = 0; i < DRDOSExtendedFontFileHeader.num_fonts_per_codepage; ++i)
+		if (options.output == OUTPUT_ELF || options.output == OUTPUT_ASM || options.output == OUTPUT_EMBED)
 		{
-			fread(&DRDOSExtendedFontFileHeader.dfd_offset[i], 4, 1, fp);
+			printf("Error: -l, -a and -e write several files and can't output to stdout\n");
+			exit(1);
 		}
-		
-		if (options.debug)
+		options.stream = 1;
+
+		fflush(stdout);
+		DataFd = dup(1);
+		dup2(2, 1);
+		if (DataFd < 0)
 		{
-			printf("== DRDOSExtendedFontFileHeader ==\n");
-			printf("Fonts: %i\n", DRDOSExtendedFontFileHeader.num_fonts_per_codepage);
-			for (int i = 0; i < DRDOSExtendedFontFileHeader.num_fonts_per_codepage; ++i)
-			{
-				printf("Size: %i\nOffset: 0x%X\n", DRDOSExtendedFontFileHeader.font_cellsize[i], DRDOSExtendedFontFileHeader.dfd_offset[i]);
-			}
-			printf("\n");
+			printf("Error: Could not open stdout\n");
+			exit(1);
 		}
+#ifdef _WIN32
+		_setmode(DataFd, _O_BINARY);
+#endif
 	}
+#ifdef _WIN32
+	_setmode(0, _O_BINARY);
+#endif
 
-	fseek(fp, FontFileHeader.fih_offset, SEEK_SET);
-	fread(&FontInfoHeader.num_codepages, 2, 1, fp);
-
-	if(options.debug)
-		printf("== FontInfoHeader ==\n%i\n\n", FontInfoHeader.num_codepages);
-
-	if(!options.debug && !options.binary)
-		remove(outfile);
-
-	for (int cp = 0; cp < FontInfoHeader.num_codepages; ++cp)
+	for (int i = 0; i < InputList.count; ++i)
 	{
-		long cpeh_start = ftell(fp); // Store CodePageEntryHeader start for FONT.NT files
+		char outname[PATH_SIZE];
 
-		fread(&CodePageEntryHeader.cpeh_size, 2, 1, fp);
-		fread(&CodePageEntryHeader.next_cpeh_offset, 4, 1, fp);
-		fread(&CodePageEntryHeader.device_type, 2, 1, fp);
-		fread(&CodePageEntryHeader.device_name, 1, 8, fp);
-		fread(&CodePageEntryHeader.codepage, 2, 1, fp);
-		fread(&CodePageEntryHeader.reserved, 1, 6, fp);
-		fread(&CodePageEntryHeader.cpih_offset, 4, 1, fp);
-
-		if (CodePageEntryHeader.device_type == 2)
+		if (batch)
 		{
-			printf("Printer font, skipping...\n\n");
-			continue;
-		}
+			char stem[PATH_SIZE];
+			const char *dir = outdir ? outfile : "";
+			const char *sep = outdir && outfile[0] && outfile[strlen(outfile) - 1] != '/' ? "/" : "";
 
-		if (options.codepage && options.codepage != CodePageEntryHeader.codepage)
-		{
-			fseek(fp, CodePageEntryHeader.next_cpeh_offset, SEEK_SET);
-			continue;
+			batch_stem(stem, InputList.name[i]);
+			path_printf(outname, "%s%s%s.h", dir, sep, stem);
+			if (options.stream)
+				strcpy(outname, "-");
+			path_printf(OutputPrefix, "%s%s%s_", dir, sep, stem);
+			if (options.format == FORMAT_TEXT)
+				printf("File: %s\n", InputList.name[i]);
 		}
-
-		if(options.debug)
-			printf("== CodePageEntryHeader ==\n0x%X\n%i\n%.*s\n%i\n\n", CodePageEntryHeader.cpeh_size, CodePageEntryHeader.device_type, 8, CodePageEntryHeader.device_name, CodePageEntryHeader.codepage);
 		else
-			printf("Code Page: %i\n", CodePageEntryHeader.codepage);
-
-		fread(&CodePageInfoHeader.version, 2, 1, fp);
-		fread(&CodePageInfoHeader.num_fonts, 2, 1, fp);
-		fread(&CodePageInfoHeader.size, 2, 1, fp);
-
-		if(options.debug)
-			printf("== CodePageInfoHeader ==\n%i\n%i\n0x%X\n\n", CodePageInfoHeader.version, CodePageInfoHeader.num_fonts, CodePageInfoHeader.size);
-
-		for (int font = 0; font < CodePageInfoHeader.num_fonts; ++font)
-		{
-			unsigned char *data;
-			FILE *out;
-
-			fread(&ScreenFontHeader.height, 1, 1, fp);
-			fread(&ScreenFontHeader.width, 1, 1, fp);
-			fread(&ScreenFontHeader.yaspect, 1, 1, fp);
-			fread(&ScreenFontHeader.xaspect, 1, 1, fp);
-			fread(&ScreenFontHeader.num_chars, 2, 1, fp);
-
-			if(options.debug)
-				printf("== ScreenFontHeader ==\n%i\n%i\n%i\n", ScreenFontHeader.height, ScreenFontHeader.width, ScreenFontHeader.num_chars);
-			else
-				printf("%ix%i\t%i characters\n", ScreenFontHeader.width, ScreenFontHeader.height, ScreenFontHeader.num_chars);
-
-			if (FontFileHeader.id0 == 0x7F) continue;
-
-			long offset = ScreenFontHeader.num_chars * ScreenFontHeader.height;
-			if(options.debug)
-				printf("Bitmap length: 0x%X\n", offset);
-
-			if(options.num_ranges == 0)
-			{
-				options.range[0][0] = 0;
-				options.range[0][1] = ScreenFontHeader.num_chars - 1;
-
-				options.num_ranges = 1;
-			}
-
-			if (!options.info)
-			{
-				data = (unsigned char *)malloc(sizeof(unsigned char) * offset);
-				fread(data, 1, offset, fp);
-				if (options.binary)
-				{
-					sprintf(outfile, "CP%i_%ix%i__1bpp.bin", CodePageEntryHeader.codepage, ScreenFontHeader.width, ScreenFontHeader.height);
-					out = fopen(outfile, "wb");
-					if (out == NULL)
-					{
-						printf("Error: Could not open output file %s\n", outfile);
-						exit(1);
-					}
-					for (int num = 0; num < options.num_ranges; ++num)
-					{
-						for (int r = options.range[num][0]; r < (options.range[num][1] + 1); ++r)
-						{
-							int start = r * ScreenFontHeader.height;
-							int end = start + ScreenFontHeader.height;
-							for (int i = start; i < end; ++i)
-								fwrite(&data[i], 1, 1, out);
-						}
-					}
-					fclose(out);
-				}
-				else
-				{
-					out = fopen(outfile, "a");
-					if (out == NULL)
-					{
-						printf("Error: Could not open output file %s\n", outfile);
-						exit(1);
-					}
-					int count = 0;
-					for (int num = 0; num < options.num_ranges; ++num)
-					{
-						count += (options.range[num][1] + 1) - options.range[num][0];
-					}
-					int bytes = (ScreenFontHeader.height * count);
-					fprintf(out, "const unsigned char CP%i_%ix%i__1bpp[%i] = {\n", CodePageEntryHeader.codepage, ScreenFontHeader.width, ScreenFontHeader.height, bytes);
-					for (int num = 0; num < options.num_ranges; ++num)
-					{
-						int col = 0;
-						for (int r = options.range[num][0]; r < (options.range[num][1] + 1); ++r)
-						{
-							int start = r * ScreenFontHeader.height;
-							int end = start + ScreenFontHeader.height;
-							for (int i = start; i < end; ++i)
-							{
-								if (r == options.range[num][1] && i == (end - 1) && num == (options.num_ranges - 1))
-									fprintf(out, "0x%02X};\n", data[i]);
-								else
-									fprintf(out, "0x%02X,", data[i]);
-								if (++col == ScreenFontHeader.height)
-								{
-									fprintf(out, "\n");
-									col = 0;
-								}
-							}
-						}
-					}
-					fclose(out);
-				}
-				free(data);
-			}
-			else
-				fseek(fp, offset, SEEK_CUR);
-		}
-		printf("\n");
-
-		if (FontFileHeader.id0 == 0x7F && !options.info)
 		{
-			unsigned char buf[32];
-			FILE *out;
-
-			if (options.num_ranges == 0)
-			{
-				options.range[0][0] = 0;
-				options.range[0][1] = 255;
-
-				options.num_ranges = 1;
-			}
-
-			fread(&CharacterIndexTable.FontIndex, 2, 256, fp);
-
-			if (options.binary)
-			{
-				for (int num_fonts = 0; num_fonts < DRDOSExtendedFontFileHeader.num_fonts_per_codepage; ++num_fonts)
-				{
-					sprintf(outfile, "CP%i_8x%i__1bpp", CodePageEntryHeader.codepage, DRDOSExtendedFontFileHeader.font_cellsize[num_fonts]);
-					out = fopen(outfile, "wb");
-					if (out == NULL)
-					{
-						printf("Error: Could not open output file %s\n", outfile);
-						exit(1);
-					}
-					for (int num = 0; num < options.num_ranges; ++num)
-					{
-						for (int i = options.range[num][0]; i < (options.range[num][1] + 1); ++i)
-						{
-							long bitmap_offset = (CharacterIndexTable.FontIndex[i] * DRDOSExtendedFontFileHeader.font_cellsize[num_fonts]) + DRDOSExtendedFontFileHeader.dfd_offset[num_fonts];
-							fseek(fp, bitmap_offset, SEEK_SET);
-							fread(&buf, 1, DRDOSExtendedFontFileHeader.font_cellsize[num_fonts], fp);
-							for (int height = 0; height < DRDOSExtendedFontFileHeader.font_cellsize[num_fonts]; ++height)
-								fwrite(&buf[height], 1, 1, out);
-						}
-					}
-					fclose(out);
-				}
-			}
-			else
-			{
-				out = fopen(outfile, "a");
-				if (out == NULL)
-				{
-					printf("Error: Could not open output file %s\n", outfile);
-					exit(1);
-				}
-				for (int num_fonts = 0; num_fonts < DRDOSExtendedFontFileHeader.num_fonts_per_codepage; ++num_fonts)
-				{
-					int count = 0;
-					for (int num = 0; num < options.num_ranges; ++num)
-					{
-						count += (options.range[num][1] + 1) - options.range[num][0];
-					}
-					int bytes = (DRDOSExtendedFontFileHeader.font_cellsize[num_fonts] * count);
-					fprintf(out, "const unsigned char CP%i_8x%i__1bpp[%i] = {\n", CodePageEntryHeader.codepage, DRDOSExtendedFontFileHeader.font_cellsize[num_fonts], bytes);
-					for (int num = 0; num < options.num_ranges; ++num)
-					{
-						for (int i = options.range[num][0]; i < (options.range[num][1] + 1); ++i)
-						{
-							long bitmap_offset = (CharacterIndexTable.FontIndex[i] * DRDOSExtendedFontFileHeader.font_cellsize[num_fonts]) + DRDOSExtendedFontFileHeader.dfd_offset[num_fonts];
-							fseek(fp, bitmap_offset, SEEK_SET);
-							fread(&buf, 1, DRDOSExtendedFontFileHeader.font_cellsize[num_fonts], fp);
-							for (int height = 0; height < DRDOSExtendedFontFileHeader.font_cellsize[num_fonts]; ++height)
-							{
-								fprintf(out, "0x%02X", buf[height]);
-								if (height < (DRDOSExtendedFontFileHeader.font_cellsize[num_fonts] - 1))
-									fprintf(out, ",");
-							}
-							if (i == options.range[num][1] && num == (options.num_ranges - 1))
-								fprintf(out, "};\n\n");
-							else
-								fprintf(out, ",\n");
-						}
-					}
-				}
-				fclose(out);
-			}
+			strcpy(outname, outfile);
+			// The .bin files go next to the .S file or header including them
+			if (options.output == OUTPUT_ASM || options.output == OUTPUT_EMBED)
+				path_printf(OutputPrefix, "%.*s", (int)(base_name(outfile) - outfile), outfile);
 		}
 
-		if (strncmp(FontFileHeader.id, "FONT.NT", 7) == 0)
-		{
-			fseek(fp, cpeh_start, SEEK_SET);
-			fseek(fp, CodePageEntryHeader.next_cpeh_offset, SEEK_CUR);
-		}
-		else
-			fseek(fp, CodePageEntryHeader.next_cpeh_offset, SEEK_SET);
+		process_file(InputList.name[i], outname);
 	}
+	if (Deps.file != NULL && !options.info)
+		write_depfile(Deps.file);
 
-	fclose(fp);
+	if (options.stats == STATS_JSON && InputList.count > 1)
+	{
+		printf("{\"files\":%i,\"total\":{", InputList.count);
+		print_counters(&RunStats);
+		printf("}\n");
+	}
+	else if (options.stats && InputList.count > 1)
+	{
+		printf("== Stats: %i files ==\nTotal", InputList.count);
+		print_counters(&RunStats);
+	}
 
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,610 @@
+/********************************************************************************************
+* libcpi
+* Parser for DOS, FONT.NT and DR-DOS code page information (CPI) files.
+*
+* Description of CPI file format sourced from:
+* http://www.seasip.info/DOS/CPI/cpi.html
+*
+* cpi2hex is free and open source software provided under the terms of The MIT License (MIT)
+* See accompanying license file for details.
+*
+* Copyright (C) 2017 by Peter McKeon 15/10/2017
+*********************************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#include "libcpi.h"
+
+#define FONT_FILE_HEADER_SIZE 23
+#define CODE_PAGE_ENTRY_HEADER_SIZE 28
+#define CODE_PAGE_INFO_HEADER_SIZE 6
+#define SCREEN_FONT_HEADER_SIZE 6
+#define CHARACTER_INDEX_TABLE_SIZE (256 * 2)
+
+#define UPX_F_DOS_COM 1
+#define UPX_PACK_HEADER_SIZE 22
+
+static int in_file(const struct cpi_file *cpi, long offset, long len)
+{
+	return offset >= 0 && len >= 0 && offset <= cpi->size - len;
+}
+
+static unsigned int get_u16(const unsigned char *p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static long get_u32(const unsigned char *p)
+{
+	return (long)((unsigned long)p[0] | ((unsigned long)p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24));
+}
+
+// UPX PackHeader of a .COM file, as written by UPX 1.0 and later
+struct cpx_header
+{
+	long offset;           // Of the "UPX!" magic, the compressed data follows the header
+	int version;
+	int format;
+	int method;
+	unsigned long u_adler;
+	unsigned long c_adler;
+	long u_len;
+	long c_len;
+	int filter;
+};
+
+// The header is looked for in the loader stub at the start of the file, like UPX does
+static int read_cpx_header(const unsigned char *p, long size, struct cpx_header *ph)
+{
+	for (long i = 0; i + UPX_PACK_HEADER_SIZE <= size && i < 128; ++i)
+	{
+		if (memcmp(p + i, "UPX!", 4) != 0)
+			continue;
+
+		const unsigned char *h = p + i;
+		unsigned int sum = 0;
+		for (int n = 4; n < UPX_PACK_HEADER_SIZE - 1; ++n)
+			sum += h[n];
+		if (h[4] < 10 || h[5] != UPX_F_DOS_COM || sum % 251 != h[UPX_PACK_HEADER_SIZE - 1])
+			continue;
+
+		ph->offset = i;
+		ph->version = h[4];
+		ph->format = h[5];
+		ph->method = h[6];
+		ph->u_adler = (unsigned long)get_u32(h + 8);
+		ph->c_adler = (unsigned long)get_u32(h + 12);
+		ph->u_len = get_u16(h + 16);
+		ph->c_len = get_u16(h + 18);
+		ph->filter = h[20];
+		return 1;
+	}
+	return 0;
+}
+
+static unsigned long adler32(const unsigned char *p, long len)
+{
+	unsigned long a = 1, b = 0;
+	for (long i = 0; i < len; ++i)
+	{
+		a = (a + p[i]) % 65521;
+		b = (b + a) % 65521;
+	}
+	return (b << 16) | a;
+}
+
+// Bits are taken most significant first from 8, 16 or 32 bit little endian words, with
+// literal bytes read from the same stream in between
+struct bit_reader
+{
+	const unsigned char *src;
+	long len;
+	long pos;
+	unsigned long bb;
+	int bc;
+	int width;
+	int error;
+};
+
+static int get_bit(struct bit_reader *r)
+{
+	if (r->bc == 0)
+	{
+		if (r->pos > r->len - r->width / 8)
+		{
+			r->error = 1;
+			return 1; // Ends every loop reading bits
+		}
+		r->bb = 0;
+		for (int i = r->width / 8 - 1; i >= 0; --i)
+			r->bb = (r->bb << 8) | r->src[r->pos + i];
+		r->pos += r->width / 8;
+		r->bc = r->width;
+	}
+	return (r->bb >> --r->bc) & 1;
+}
+
+// NRV2B, NRV2D and NRV2E decompression as in UCL, for methods 2 to 10 (each algorithm
+// in 32, 8 and 16 bit variants)
+static int nrv_unpack(int method, const unsigned char *src, long c_len, unsigned char *dst, long u_len)
+{
+	static const int widths[3] = { 32, 8, 16 };
+	struct bit_reader r = { src, c_len, 0, 0, 0, 0, 0 };
+	int algo = (method - 2) / 3; // 0 NRV2B, 1 NRV2D, 2 NRV2E
+	unsigned long last_m_off = 1;
+	long olen = 0;
+
+	if (method < 2 || method > 10)
+		return CPI_ERROR_FORMAT;
+	r.width = widths[(method - 2) % 3];
+
+	for (;;)
+	{
+		while (get_bit(&r) && !r.error)
+		{
+			if (r.pos >= c_len || olen >= u_len)
+				return CPI_ERROR_TRUNCATED;
+			dst[olen++] = src[r.pos++];
+		}
+
+		unsigned long m_off = 1;
+		unsigned long m_len = 0;
+		if (algo == 0)
+		{
+			do
+				m_off = m_off * 2 + get_bit(&r);
+			while (!get_bit(&r) && m_off <= 0x1000002);
+		}
+		else
+		{
+			for (;;)
+			{
+				m_off = m_off * 2 + get_bit(&r);
+				if (get_bit(&r) || m_off > 0x1000002)
+					break;
+				m_off = (m_off - 1) * 2 + get_bit(&r);
+			}
+		}
+		if (r.error || m_off > 0x1000002)
+			return CPI_ERROR_TRUNCATED;
+
+		if (m_off == 2)
+		{
+			m_off = last_m_off;
+			if (algo != 0)
+				m_len = get_bit(&r);
+		}
+		else
+		{
+			if (r.pos >= c_len)
+				return CPI_ERROR_TRUNCATED;
+			m_off = (m_off - 3) * 256 + src[r.pos++];
+			if (m_off == 0xFFFFFFFF)
+				break;
+			if (algo != 0)
+			{
+				m_len = (m_off & 1) ^ 1;
+				m_off >>= 1;
+			}
+			last_m_off = ++m_off;
+		}
+		if (algo == 0)
+			m_len = get_bit(&r);
+
+		if (algo == 2)
+		{
+			if (m_len)
+				m_len = 1 + get_bit(&r);
+			else if (get_bit(&r))
+				m_len = 3 + get_bit(&r);
+			else
+			{
+				m_len = 1;
+				do
+					m_len = m_len * 2 + get_bit(&r);
+				while (!get_bit(&r) && m_len <= (unsigned long)u_len);
+				m_len += 3;
+			}
+		}
+		else
+		{
+			m_len = m_len * 2 + get_bit(&r);
+			if (m_len == 0)
+			{
+				m_len = 1;
+				do
+					m_len = m_len * 2 + get_bit(&r);
+				while (!get_bit(&r) && m_len <= (unsigned long)u_len);
+				m_len += 2;
+			}
+		}
+		m_len += 1 + (m_off > (algo == 0 ? 0xD00UL : 0x500UL));
+
+		if (r.error || m_off > (unsigned long)olen || m_len > (unsigned long)(u_len - olen))
+			return CPI_ERROR_TRUNCATED;
+		for (unsigned char *m_pos = dst + olen - m_off; m_len > 0; --m_len)
+			dst[olen++] = *m_pos++;
+	}
+
+	return olen == u_len ? CPI_OK : CPI_ERROR_TRUNCATED;
+}
+
+// Undo the 16 bit call trick filters (1 to 6), which turn the target of each E8 call and/or
+// E9 jump into an absolute address relative to the .COM load address of 0x100. Filters 4 to 6
+// also store the address big endian, so it is read big endian and written back little endian.
+static int unfilter_ct16(int filter, unsigned char *buf, long len)
+{
+	if (filter == 0)
+		return CPI_OK;
+	if (filter < 1 || filter > 6)
+		return CPI_ERROR_FORMAT;
+
+	int e8 = filter != 2 && filter != 5;
+	int e9 = filter != 1 && filter != 4;
+	int bswap = filter > 3;
+	for (long i = 0; i < len - 3; ++i)
+	{
+		if ((buf[i] == 0xE8 && e8) || (buf[i] == 0xE9 && e9))
+		{
+			unsigned int stored = bswap ? (unsigned int)(buf[i + 1] << 8 | buf[i + 2]) : get_u16(buf + i + 1);
+			unsigned int value = (stored - (unsigned int)(i + 1) - 0x100) & 0xFFFF;
+			buf[i + 1] = (unsigned char)value;
+			buf[i + 2] = (unsigned char)(value >> 8);
+			i += 2;
+		}
+	}
+	return CPI_OK;
+}
+
+long cpi_cpx_size(const void *data, long size)
+{
+	struct cpx_header ph;
+	return read_cpx_header((const unsigned char *)data, size, &ph) ? ph.u_len : 0;
+}
+
+int cpi_cpx_unpack(const void *data, long size, void *out)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	struct cpx_header ph;
+
+	if (!read_cpx_header(p, size, &ph))
+		return CPI_ERROR_FORMAT;
+
+	const unsigned char *src = p + ph.offset + UPX_PACK_HEADER_SIZE;
+	if (ph.c_len > size - (ph.offset + UPX_PACK_HEADER_SIZE))
+		return CPI_ERROR_TRUNCATED;
+	if (adler32(src, ph.c_len) != ph.c_adler)
+		return CPI_ERROR_CHECKSUM;
+
+	int err = nrv_unpack(ph.method, src, ph.c_len, (unsigned char *)out, ph.u_len);
+	if (err != CPI_OK)
+		return err;
+	if (adler32((const unsigned char *)out, ph.u_len) != ph.u_adler)
+		return CPI_ERROR_CHECKSUM;
+
+	return unfilter_ct16(ph.filter, (unsigned char *)out, ph.u_len);
+}
+
+static void release(const unsigned char *data, long size, int owner)
+{
+#ifndef _WIN32
+	if (owner == CPI_MAPPED)
+		munmap((void *)data, size);
+#endif
+	if (owner == CPI_ALLOCATED)
+		free((void *)data);
+}
+
+// Take ownership of a file image, unpacking it first if it is a CPX file
+static int open_owned(struct cpi_file *cpi, unsigned char *data, long size, int owner, int syscalls)
+{
+	long unpacked = cpi_cpx_size(data, size);
+	if (unpacked > 0)
+	{
+		unsigned char *buf = (unsigned char *)malloc(unpacked);
+		int err = buf != NULL ? cpi_cpx_unpack(data, size, buf) : CPI_ERROR_IO;
+		release(data, size, owner);
+		syscalls += owner == CPI_MAPPED;
+		if (err != CPI_OK)
+		{
+			free(buf);
+			return err;
+		}
+		data = buf;
+		size = unpacked;
+		owner = CPI_ALLOCATED;
+	}
+
+	int err = cpi_open_buffer(cpi, data, size);
+	cpi->mapped = owner;
+	cpi->syscalls = syscalls;
+	return err;
+}
+
+int cpi_open_buffer(struct cpi_file *cpi, const void *data, long size)
+{
+	const unsigned char *p = (const unsigned char *)data;
+
+	memset(cpi, 0, sizeof(*cpi));
+	cpi->data = p;
+	cpi->size = size;
+
+	if (size < 1 || (p[0] != 0xFF && p[0] != 0x7F))
+		return CPI_ERROR_FORMAT;
+	if (!in_file(cpi, 0, FONT_FILE_HEADER_SIZE))
+		return CPI_ERROR_TRUNCATED;
+
+	cpi->id0 = p[0];
+	memcpy(cpi->id, p + 1, 7);
+	memcpy(cpi->reserved, p + 8, 8);
+	cpi->pnum = get_u16(p + 16);
+	cpi->ptyp = p[18];
+	cpi->fih_offset = get_u32(p + 19);
+
+	if (cpi->id0 == 0x7F)
+	{
+		if (!in_file(cpi, FONT_FILE_HEADER_SIZE, 1))
+			return CPI_ERROR_TRUNCATED;
+		cpi->drdos_fonts = p[FONT_FILE_HEADER_SIZE];
+		if (!in_file(cpi, FONT_FILE_HEADER_SIZE + 1, cpi->drdos_fonts * 5L))
+			return CPI_ERROR_TRUNCATED;
+	}
+
+	if (!in_file(cpi, cpi->fih_offset, 2))
+		return CPI_ERROR_TRUNCATED;
+	cpi->num_codepages = get_u16(p + cpi->fih_offset);
+
+	return CPI_OK;
+}
+
+int cpi_open_fd(struct cpi_file *cpi, int fd)
+{
+	unsigned char *buf = NULL;
+	long size = 0;
+	long cap = 0;
+	int syscalls = 0;
+
+	memset(cpi, 0, sizeof(*cpi));
+
+#ifndef _WIN32
+	struct stat st;
+	++syscalls;
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	{
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		++syscalls;
+		if (map != MAP_FAILED)
+			return open_owned(cpi, (unsigned char *)map, (long)st.st_size, CPI_MAPPED, syscalls);
+	}
+#endif
+
+	// Pipes and systems without mmap are read to the end
+	for (;;)
+	{
+		if (size == cap)
+		{
+			cap = cap ? cap * 2 : 64 * 1024;
+			unsigned char *grown = (unsigned char *)realloc(buf, cap);
+			if (grown == NULL)
+			{
+				free(buf);
+				return CPI_ERROR_IO;
+			}
+			buf = grown;
+		}
+#ifdef _WIN32
+		int n = _read(fd, buf + size, (unsigned int)(cap - size));
+#else
+		long n = (long)read(fd, buf + size, cap - size);
+#endif
+		++syscalls;
+		if (n < 0)
+		{
+			free(buf);
+			return CPI_ERROR_IO;
+		}
+		if (n == 0)
+			break;
+		size += n;
+	}
+
+	return open_owned(cpi, buf, size, CPI_ALLOCATED, syscalls);
+}
+
+void cpi_close(struct cpi_file *cpi)
+{
+	release(cpi->data, cpi->size, cpi->mapped);
+	cpi->data = NULL;
+	cpi->size = 0;
+	cpi->mapped = CPI_BUFFER;
+}
+
+int cpi_drdos_font(const struct cpi_file *cpi, int n, int *cellsize, long *offset)
+{
+	if (n < 0 || n >= cpi->drdos_fonts)
+		return CPI_ERROR_FORMAT;
+
+	const unsigned char *p = cpi->data + FONT_FILE_HEADER_SIZE + 1;
+	*cellsize = p[n];
+	*offset = get_u32(p + cpi->drdos_fonts + n * 4);
+	return CPI_OK;
+}
+
+int cpi_first_codepage(const struct cpi_file *cpi, struct cpi_codepage *cp)
+{
+	memset(cp, 0, sizeof(*cp));
+	cp->index = -1;
+	cp->next = cpi->fih_offset + 2;
+	return cpi_next_codepage(cpi, cp);
+}
+
+int cpi_next_codepage(const struct cpi_file *cpi, struct cpi_codepage *cp)
+{
+	if (cp->index + 1 >= cpi->num_codepages)
+		return CPI_END;
+
+	long offset = cp->next;
+	if (!in_file(cpi, offset, CODE_PAGE_ENTRY_HEADER_SIZE))
+		return CPI_ERROR_TRUNCATED;
+
+	const unsigned char *p = cpi->data + offset;
+	cp->index++;
+	cp->offset = offset;
+	cp->cpeh_size = get_u16(p);
+	cp->next_cpeh_offset = get_u32(p + 2);
+	cp->device_type = get_u16(p + 6);
+	memcpy(cp->device_name, p + 8, 8);
+	cp->codepage = get_u16(p + 16);
+	cp->cpih_offset = get_u32(p + 24);
+
+	cp->next = cp->next_cpeh_offset;
+	if (memcmp(cpi->id, "FONT.NT", 7) == 0)
+		cp->next += offset; // FONT.NT offsets are relative to the entry header
+
+	cp->version = 0;
+	cp->num_fonts = 0;
+	cp->size = 0;
+	if (cp->device_type != CPI_DEVICE_PRINTER)
+	{
+		// The CodePageInfoHeader follows the entry header
+		if (!in_file(cpi, offset + CODE_PAGE_ENTRY_HEADER_SIZE, CODE_PAGE_INFO_HEADER_SIZE))
+			return CPI_ERROR_TRUNCATED;
+		p += CODE_PAGE_ENTRY_HEADER_SIZE;
+		cp->version = get_u16(p);
+		cp->num_fonts = get_u16(p + 2);
+		cp->size = get_u16(p + 4);
+	}
+
+	return CPI_OK;
+}
+
+static void read_screen_font_header(const unsigned char *p, struct cpi_font *font)
+{
+	font->height = p[0];
+	font->width = p[1];
+	font->yaspect = p[2];
+	font->xaspect = p[3];
+	font->num_chars = get_u16(p + 4);
+	font->stride = font->height * ((font->width + 7) / 8);
+}
+
+int cpi_font(const struct cpi_file *cpi, const struct cpi_codepage *cp, int n, int views, struct cpi_font *font)
+{
+	if (cp->device_type == CPI_DEVICE_PRINTER || n < 0 || n >= cp->num_fonts)
+		return CPI_ERROR_FORMAT;
+
+	memset(font, 0, sizeof(*font));
+
+	// ScreenFontHeaders follow the CodePageInfoHeader, each followed by its bitmap except
+	// in DR-DOS files, where they are packed together ahead of the CharacterIndexTable
+	long pos = cp->offset + CODE_PAGE_ENTRY_HEADER_SIZE + CODE_PAGE_INFO_HEADER_SIZE;
+	for (int i = 0; i <= n; ++i)
+	{
+		if (!in_file(cpi, pos, SCREEN_FONT_HEADER_SIZE))
+			return CPI_ERROR_TRUNCATED;
+		read_screen_font_header(cpi->data + pos, font);
+		pos += SCREEN_FONT_HEADER_SIZE;
+		if (i < n && cpi->id0 != 0x7F)
+			pos += (long)font->num_chars * font->stride;
+	}
+
+	if (cpi->id0 == 0x7F)
+	{
+		int cellsize = 0;
+		long offset = 0;
+		int found = 0;
+
+		// Pick the glyph pool of the same cell size, or failing that the one in the same position
+		for (int i = 0; i < cpi->drdos_fonts && !found; ++i)
+		{
+			cpi_drdos_font(cpi, i, &cellsize, &offset);
+			found = cellsize == font->height;
+		}
+		if (!found && cpi_drdos_font(cpi, n, &cellsize, &offset) != CPI_OK)
+			return CPI_ERROR_FORMAT;
+
+		font->height = cellsize;
+		font->stride = font->height * ((font->width + 7) / 8);
+		if (font->num_chars > 256)
+			font->num_chars = 256;
+		font->bitmap_offset = offset;
+		font->index_offset = cp->offset + CODE_PAGE_ENTRY_HEADER_SIZE + CODE_PAGE_INFO_HEADER_SIZE + (long)cp->num_fonts * SCREEN_FONT_HEADER_SIZE;
+	}
+	else
+	{
+		font->bitmap_offset = pos;
+		font->index_offset = 0;
+	}
+
+	return views ? cpi_font_view(cpi, font) : CPI_OK;
+}
+
+int cpi_font_view(const struct cpi_file *cpi, struct cpi_font *font)
+{
+	long chars = font->num_chars;
+
+	font->bitmap = NULL;
+	font->index = NULL;
+
+	if (font->index_offset)
+	{
+		// Only the part of the shared pool this code page refers to has to be present
+		if (!in_file(cpi, font->index_offset, CHARACTER_INDEX_TABLE_SIZE) || font->num_chars > 256)
+			return CPI_ERROR_TRUNCATED;
+		const unsigned char *index = cpi->data + font->index_offset;
+		chars = 0;
+		for (int i = 0; i < font->num_chars; ++i)
+		{
+			long glyph = get_u16(index + i * 2);
+			if (glyph + 1 > chars)
+				chars = glyph + 1;
+		}
+		font->index = index;
+	}
+
+	if (!in_file(cpi, font->bitmap_offset, chars * font->stride))
+	{
+		font->index = NULL;
+		return CPI_ERROR_TRUNCATED;
+	}
+	font->bitmap = cpi->data + font->bitmap_offset;
+
+	return CPI_OK;
+}
+
+const unsigned char *cpi_glyph(const struct cpi_font *font, int c)
+{
+	if (font->index != NULL)
+		return font->bitmap + (long)get_u16(font->index + c * 2) * font->stride;
+
+	return font->bitmap + (long)c * font->stride;
+}
+
+const char *cpi_strerror(int error)
+{
+	switch (error)
+	{
+	case CPI_OK:
+		return "No error";
+	case CPI_END:
+		return "No more code pages";
+	case CPI_ERROR_IO:
+		return "Could not read file";
+	case CPI_ERROR_FORMAT:
+		return "Unsupported file type";
+	case CPI_ERROR_TRUNCATED:
+		return "Unexpected end of file";
+	case CPI_ERROR_CHECKSUM:
+		return "Checksum mismatch in compressed file";
+	}
+	return "Unknown error";
+}
@@ -0,0 +1,149 @@
+/********************************************************************************************
+* libcpi
+* Parser for DOS, FONT.NT and DR-DOS code page information (CPI) files.
+*
+* All parsing works on an in-memory image of the file and returns views into it, so
+* walking code pages and reading glyphs never allocates. There is no global state: any
+* number of files can be parsed at once, and a cpi_file can be shared between threads
+* once it has been opened.
+*
+* Description of CPI file format sourced from:
+* http://www.seasip.info/DOS/CPI/cpi.html
+*
+* cpi2hex is free and open source software provided under the terms of The MIT License (MIT)
+* See accompanying license file for details.
+*
+* Copyright (C) 2017 by Peter McKeon 15/10/2017
+*********************************************************************************************/
+
+#ifndef LIBCPI_H
+#define LIBCPI_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+enum
+{
+	CPI_OK = 0,
+	CPI_END,              // No more code pages
+	CPI_ERROR_IO,         // The file could not be read
+	CPI_ERROR_FORMAT,     // Not a CPI file, or a structure that can't be used (eg. a printer font)
+	CPI_ERROR_TRUNCATED,  // A header or bitmap lies outside the file
+	CPI_ERROR_CHECKSUM    // A CPX file does not unpack to the data it was packed from
+};
+
+#define CPI_DEVICE_SCREEN 1
+#define CPI_DEVICE_PRINTER 2
+
+// How the data of a cpi_file is held
+#define CPI_BUFFER 0          // Supplied to cpi_open_buffer by the caller
+#define CPI_MAPPED 1          // Mapped from the file, so offsets into data are file offsets
+#define CPI_ALLOCATED 2       // Read or unpacked into memory, released by cpi_close
+
+struct cpi_file
+{
+	const unsigned char *data;
+	long size;
+	int mapped;           // CPI_BUFFER, CPI_MAPPED or CPI_ALLOCATED
+	int syscalls;         // fstat, mmap, read and munmap calls made by cpi_open_fd
+
+	// FontFileHeader
+	unsigned char id0;    // 0xFF for DOS and FONT.NT files, 0x7F for DR-DOS
+	char id[7];           // "FONT   ", "FONT.NT" or "DRFONT "
+	char reserved[8];
+	int pnum;
+	int ptyp;
+	long fih_offset;
+
+	// FontInfoHeader
+	int num_codepages;
+
+	// DRDOSExtendedFontFileHeader, 0 for other files. See cpi_drdos_font.
+	int drdos_fonts;
+};
+
+struct cpi_codepage
+{
+	int index;            // Position in the entry chain
+	long offset;          // Absolute offset of the CodePageEntryHeader
+	long next;            // Absolute offset of the next CodePageEntryHeader
+
+	// CodePageEntryHeader
+	int cpeh_size;
+	long next_cpeh_offset; // As stored, relative to offset in FONT.NT files
+	int device_type;
+	char device_name[8];
+	int codepage;
+	long cpih_offset;
+
+	// CodePageInfoHeader, only read for screen fonts
+	int version;
+	int num_fonts;
+	int size;
+};
+
+struct cpi_font
+{
+	// ScreenFontHeader
+	int height;
+	int width;
+	int yaspect;
+	int xaspect;
+	int num_chars;
+
+	int stride;           // Bytes per glyph, height rows of (width + 7) / 8 bytes
+	long bitmap_offset;   // Bitmap, or the shared glyph pool for DR-DOS files
+	long index_offset;    // DR-DOS CharacterIndexTable, 0 for other files
+
+	// Views set by cpi_font_view
+	const unsigned char *bitmap;
+	const unsigned char *index;
+};
+
+// Open a CPI image held in memory. data must stay valid until the file is no longer used.
+int cpi_open_buffer(struct cpi_file *cpi, const void *data, long size);
+
+// Open a CPI file from a file descriptor, mapping it into memory where possible. CPX files
+// are unpacked. The descriptor can be closed afterwards. Release the file with cpi_close.
+int cpi_open_fd(struct cpi_file *cpi, int fd);
+
+// CPX files are CPI files packed into a DOS .COM program by UPX. cpi_cpx_size returns the
+// unpacked size, or 0 if data is not a CPX file, and cpi_cpx_unpack unpacks it into out,
+// which must hold that many bytes. The result can be opened with cpi_open_buffer.
+long cpi_cpx_size(const void *data, long size);
+int cpi_cpx_unpack(const void *data, long size, void *out);
+
+void cpi_close(struct cpi_file *cpi);
+
+// Cell height and glyph pool offset of font n from a DR-DOS extended header
+int cpi_drdos_font(const struct cpi_file *cpi, int n, int *cellsize, long *offset);
+
+// Iterate the code page entry chain. Both return CPI_END after the last code page. The
+// CodePageInfoHeader is only read for screen fonts.
+int cpi_first_codepage(const struct cpi_file *cpi, struct cpi_codepage *cp);
+int cpi_next_codepage(const struct cpi_file *cpi, struct cpi_codepage *cp);
+
+// Read font n (0 to num_fonts - 1) of a screen font code page. With views set the bitmap is
+// bounds checked and can be read through cpi_glyph, otherwise only the headers are read.
+int cpi_font(const struct cpi_file *cpi, const struct cpi_codepage *cp, int n, int views, struct cpi_font *font);
+
+// Bounds check a font described by its size and offsets, eg. one loaded from a saved index,
+// and set its bitmap views
+int cpi_font_view(const struct cpi_file *cpi, struct cpi_font *font);
+
+// Bitmap of character c, stride bytes long. c must be below num_chars.
+const unsigned char *cpi_glyph(const struct cpi_font *font, int c);
+
+const char *cpi_strerror(int error);
+
+// Unicode code point of each of the 256 characters of a code page, 0 where there is none, or
+// NULL for a code page without a table. 0x01-0x1F and 0x7F map to the symbols CPI fonts draw
+// for them (U+263A, U+263B, ... and U+2302) rather than to control characters.
+const unsigned short *cpi_unicode(int codepage);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
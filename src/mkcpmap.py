@@ -0,0 +1,72 @@
+#!/usr/bin/env python3
+# Generates cpmap.c, the code page to Unicode tables of libcpi, from Python's codecs.
+# Run from the src directory: python3 mkcpmap.py > cpmap.c
+
+import codecs
+
+# DOS code pages found in CPI files that Python has a codec for. 853 has none.
+CODE_PAGES = [437, 720, 737, 775, 850, 852, 855, 857, 858, 860, 861, 862, 863, 864, 865, 866, 869, 874, 1125]
+
+# The glyphs CPI fonts draw for the control characters 0x01-0x1F and 0x7F
+CONTROL_GLYPHS = "☺☻♥♦♣♠•◘○◙♂♀♪♫☼" \
+	"►◄↕‼¶§▬↨↑↓→←∟↔▲▼"
+DEL_GLYPH = "⌂"
+
+
+def table(cp):
+	codec = codecs.lookup("cp%i" % cp)
+	values = []
+	for c in range(256):
+		try:
+			u = ord(codec.decode(bytes([c]))[0])
+		except UnicodeDecodeError:
+			u = 0
+		if 1 <= c < 0x20 and u == c:
+			u = ord(CONTROL_GLYPHS[c - 1])
+		elif c == 0x7F and u == 0x7F:
+			u = ord(DEL_GLYPH)
+		values.append(u)
+	return values
+
+
+print("""/********************************************************************************************
+* libcpi
+* Code page to Unicode tables, generated by mkcpmap.py from Python's codecs. Do not edit.
+*
+* cpi2hex is free and open source software provided under the terms of The MIT License (MIT)
+* See accompanying license file for details.
+*
+* Copyright (C) 2017 by Peter McKeon 15/10/2017
+*********************************************************************************************/
+
+#include <stddef.h>
+
+#include "libcpi.h"
+""")
+
+for cp in CODE_PAGES:
+	values = table(cp)
+	print("static const unsigned short CP%i[256] =\n{" % cp)
+	for row in range(0, 256, 16):
+		line = ",".join("0x%04X" % u for u in values[row:row + 16])
+		print("\t" + line + ("," if row < 240 else ""))
+	print("};\n")
+
+print("""static const struct
+{
+	int codepage;
+	const unsigned short *unicode;
+} CodePages[] =
+{""")
+print(",\n".join("\t{ %i, CP%i }" % (cp, cp) for cp in CODE_PAGES))
+print("""};
+
+const unsigned short *cpi_unicode(int codepage)
+{
+	for (size_t i = 0; i < sizeof(CodePages) / sizeof(CodePages[0]); ++i)
+	{
+		if (CodePages[i].codepage == codepage)
+			return CodePages[i].unicode;
+	}
+	return NULL;
+}""")
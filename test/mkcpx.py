@@ -0,0 +1,186 @@
+#!/usr/bin/env python3
+# Packs a CPI file into a CPX file laid out the way UPX packs a DOS .COM program, so make test
+# can check the unpacker without UPX: a stub, the PackHeader, then the file run through a call
+# trick filter and compressed with NRV2B, NRV2D or NRV2E. The matches are found greedily, which
+# packs less tightly than UPX but uses every code of the bit stream.
+# python3 mkcpx.py [-m method] [-f filter] in.cpi out.cpx
+
+import argparse
+import struct
+import zlib
+
+UPX_F_DOS_COM = 1
+UPX_VERSION = 13
+STUB = bytes([0xB4, 0x4C, 0xCD, 0x21])  # mov ah, 4Ch; int 21h - exits if run
+END_OF_STREAM = 0x1000002  # Offset prefix of the end marker
+MAX_CHAIN = 16
+
+
+class BitWriter:
+	# Bits go most significant first into 8, 16 or 32 bit little endian words, each taking its
+	# place in the stream when its first bit is written, with literal bytes in between
+	def __init__(self, width):
+		self.out = bytearray()
+		self.size = width // 8
+		self.word_pos = None
+		self.word = 0
+		self.count = 0
+
+	def bit(self, b):
+		if self.word_pos is None:
+			self.word_pos = len(self.out)
+			self.out += bytes(self.size)
+			self.word = 0
+			self.count = 0
+		self.word = (self.word << 1) | b
+		self.count += 1
+		if self.count == 8 * self.size:
+			self.flush()
+
+	def byte(self, b):
+		self.out.append(b)
+
+	def flush(self):
+		if self.word_pos is not None:
+			word = self.word << (8 * self.size - self.count)
+			self.out[self.word_pos:self.word_pos + self.size] = word.to_bytes(self.size, "little")
+			self.word_pos = None
+
+
+def ss11_bits(v, last=1):
+	# Each bit of v after the leading one, followed by 1 on the last and 0 otherwise
+	if v < 4:
+		return [v - 2, last]
+	return ss11_bits(v >> 1, 0) + [v & 1, last]
+
+
+def ss12_bits(v, last=1):
+	# As ss11, but every bit pair after the first is followed by one stop bit
+	if v < 4:
+		return [v - 2, last]
+	return ss12_bits(v // 4 + 1, 0) + [(v & 3) >> 1, v & 1, last]
+
+
+class Encoder:
+	def __init__(self, method):
+		self.algo = (method - 2) // 3  # 0 NRV2B, 1 NRV2D, 2 NRV2E
+		self.bw = BitWriter([32, 8, 16][(method - 2) % 3])
+		self.last_off = 1
+		self.far = 0xD00 if self.algo == 0 else 0x500
+
+	def bits(self, bits):
+		for b in bits:
+			self.bw.bit(b)
+
+	def offset(self, v):
+		self.bits(ss11_bits(v) if self.algo == 0 else ss12_bits(v))
+
+	def literal(self, c):
+		self.bw.bit(1)
+		self.bw.byte(c)
+
+	def min_len(self, off):
+		return 2 + (off > self.far)
+
+	def match(self, off, length):
+		x = length - 1 - (off > self.far)
+		if self.algo != 2:
+			low = [x >> 1, x & 1] if x < 4 else [0, 0] + ss11_bits(x - 2)
+		else:
+			low = [1, x - 1] if x <= 2 else ([0, 1, x - 3] if x <= 4 else [0, 0] + ss11_bits(x - 3))
+		# NRV2D and NRV2E carry the first length bit in the offset
+		first = low.pop(0) if self.algo != 0 else None
+
+		self.bw.bit(0)
+		if off == self.last_off:
+			self.offset(2)
+			if first is not None:
+				self.bw.bit(first)
+		else:
+			raw = off - 1 if self.algo == 0 else ((off - 1) << 1) | (first ^ 1)
+			self.offset((raw >> 8) + 3)
+			self.bw.byte(raw & 0xFF)
+			self.last_off = off
+		self.bits(low)
+
+	def end(self):
+		self.bw.bit(0)
+		self.offset(END_OF_STREAM)
+		self.bw.byte(0xFF)
+		self.bw.flush()
+		return bytes(self.bw.out)
+
+
+def match_len(data, a, b):
+	n = 0
+	while b + n < len(data) and data[a + n] == data[b + n]:
+		n += 1
+	return n
+
+
+def compress(data, method):
+	enc = Encoder(method)
+	chains = {}
+	pos = 0
+	while pos < len(data):
+		best_len, best_off = 0, 0
+		if pos >= enc.last_off:
+			best_len, best_off = match_len(data, pos - enc.last_off, pos), enc.last_off
+		key = data[pos:pos + 3]
+		for prev in reversed(chains.get(key, [])[-MAX_CHAIN:]):
+			n = match_len(data, prev, pos)
+			if n > best_len:
+				best_len, best_off = n, pos - prev
+		if best_off == 0 or best_len < enc.min_len(best_off):
+			best_len = 1
+			enc.literal(data[pos])
+		else:
+			enc.match(best_off, best_len)
+		for i in range(pos, pos + best_len):
+			chains.setdefault(data[i:i + 3], []).append(i)
+		pos += best_len
+	return enc.end()
+
+
+def call_trick(data, f):
+	# Turn the target of each E8 call and/or E9 jump into an absolute address from the .COM load
+	# address of 0x100, stored big endian by filters 4 to 6
+	buf = bytearray(data)
+	e8 = f not in (2, 5)
+	e9 = f not in (1, 4)
+	i = 0
+	while i < len(buf) - 3:
+		if (buf[i] == 0xE8 and e8) or (buf[i] == 0xE9 and e9):
+			value = (struct.unpack_from("<H", buf, i + 1)[0] + i + 1 + 0x100) & 0xFFFF
+			struct.pack_into(">H" if f > 3 else "<H", buf, i + 1, value)
+			i += 3
+		else:
+			i += 1
+	return bytes(buf)
+
+
+def main():
+	parser = argparse.ArgumentParser(description="Pack a CPI file into a CPX file")
+	parser.add_argument("-m", "--method", type=int, default=4, help="2 to 10, NRV2B, NRV2D and NRV2E each with 32, 8 and 16 bit words")
+	parser.add_argument("-f", "--filter", type=int, default=0, help="call trick filter, 0 to 6")
+	parser.add_argument("input")
+	parser.add_argument("out")
+	args = parser.parse_args()
+	if not 2 <= args.method <= 10 or not 0 <= args.filter <= 6:
+		parser.error("methods are 2 to 10 and filters 0 to 6")
+
+	with open(args.input, "rb") as f:
+		data = call_trick(f.read(), args.filter) if args.filter else f.read()
+	packed = compress(data, args.method)
+	if len(data) > 0xFFFF or len(packed) > 0xFFFF:
+		parser.error("a .COM file holds at most 64 KB")
+
+	header = struct.pack("<4sBBBBIIHHB", b"UPX!", UPX_VERSION, UPX_F_DOS_COM, args.method, 8,
+		zlib.adler32(data), zlib.adler32(packed), len(data), len(packed), args.filter)
+	header += bytes([sum(header[4:]) % 251])
+	with open(args.out, "wb") as f:
+		f.write(STUB + header + packed)
+
+
+if __name__ == "__main__":
+	main()
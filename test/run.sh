@@ -0,0 +1,68 @@
+#!/bin/sh
+# Regression checks for cpi2hex, run from the top directory with make test
+
+CPI2HEX=./cpi2hex
+failed=0
+
+fail()
+{
+	echo "FAIL: $*"
+	failed=1
+}
+
+top=$(pwd)
+tmp=$(mktemp -d)
+
+# Output to stdout must not depend on the number of worker threads, in every mode that can
+# write to stdout
+for file in test/DOS/EGA.CPI test/FONT.NT/EGA.CPI test/DRDOS/EGA.CPI
+do
+	for mode in "" "-b" "-s" "-u" "--compress=rle" "--compress=dict" "--layout=pages"
+	do
+		serial=$($CPI2HEX "$file" $mode -o - -j 1 2>/dev/null | cksum)
+		parallel=$($CPI2HEX "$file" $mode -o - -j 4 2>/dev/null | cksum)
+		[ "$serial" = "$parallel" ] || fail "-j 4 differs from -j 1 with -o - $mode on $file"
+	done
+done
+
+# Raw binary on stdout must be exactly the bytes -b writes to files, in font order, with no
+# header text in front even when the header would need <stdint.h>
+for file in test/DOS/EGA.CPI test/FONT.NT/EGA.CPI test/DRDOS/EGA.CPI
+do
+	rm -f "$tmp"/*
+	sizes=$(cd "$tmp" && "$top/$CPI2HEX" "$top/$file" -b --word=16 -c 437 | awk -F'\t' '/^[0-9]+x[0-9]+\t/ { print $1 }')
+	expected=$(for size in $sizes; do cat "$tmp"/CP437_"$size"_*; done | cksum)
+	actual=$($CPI2HEX "$file" -b --word=16 -c 437 -o - 2>/dev/null | cksum)
+	[ -n "$sizes" ] && [ "$expected" = "$actual" ] || fail "-b -o - --word=16 differs from the -b files of $file"
+done
+
+# CPX files must unpack to the CPI file they were packed from. mkcpx.py packs them as UPX
+# would: the DOS and DR-DOS fonts with every method, and a font of random glyphs, full of the
+# E8 and E9 bytes the call trick filters change, with every method and filter
+python3 bench/mkcpi.py -c 4 -s 8,16 "$tmp/RANDOM.CPI" || fail "Could not generate a CPI file"
+packed=0
+for file in test/DOS/EGA.CPI test/DRDOS/EGA.CPI "$tmp/RANDOM.CPI"
+do
+	filters=0
+	[ "$file" = "$tmp/RANDOM.CPI" ] && filters="0 1 2 3 4 5 6"
+	original=$($CPI2HEX "$file" -o - 2>/dev/null | cksum)
+	for method in 2 3 4 5 6 7 8 9 10
+	do
+		for filter in $filters
+		do
+			python3 test/mkcpx.py -m $method -f $filter "$file" "$tmp/PACKED.CPX" || { fail "Could not pack $file"; continue; }
+			packed=$((packed + 1))
+			[ "$($CPI2HEX "$tmp/PACKED.CPX" -o - 2>/dev/null | cksum)" = "$original" ] ||
+				fail "$file packed with method $method and filter $filter does not unpack to the same fonts"
+		done
+	done
+done
+[ $packed -gt 0 ] || fail "No CPX files were checked"
+
+# A CPX file damaged after packing must be rejected by the checksums rather than misread
+python3 -c 'import sys; d = bytearray(open(sys.argv[1], "rb").read()); d[100] ^= 1; open(sys.argv[1], "wb").write(d)' "$tmp/PACKED.CPX"
+$CPI2HEX "$tmp/PACKED.CPX" -i >/dev/null 2>&1 && fail "A damaged CPX file was accepted"
+
+rm -rf "$tmp"
+[ $failed -eq 0 ] && echo "All tests passed"
+exit $failed